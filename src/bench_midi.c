@@ -0,0 +1,435 @@
+// Benchmarks for the MIDI parser
+// Generates a deterministic Standard MIDI File in memory and times parse_midi, merge_sorted_chunks, write_midi and streaming it with MidiStream separately
+// Additionally times decoding commands, that were written with encode_cmd (as in version 1 .pidi files), and loading a current .pidi file
+// Every result is printed as a single line of `key=value` pairs, so that the output can be compared between versions by scripts
+//
+// Usage: bench_midi [key=value ...]
+// Keys:
+//   tracks          Amount of tracks containing notes (a conductor track with the tempo changes is added to these)
+//   notes           Amount of notes per track
+//   density         Average amount of notes per quarter-note in each track
+//   tempo_changes   Amount of Set Tempo events in the conductor track
+//   meta_noise      Percentage of notes, that are preceded by an (ignored) lyric meta event
+//   running_status  0 to write the status byte before every event, 1 to use running status
+//   reps            Amount of repetitions per benchmark (the fastest one is reported)
+//   merge_sweep     1 to also benchmark merge_sorted_chunks on random commands for 1 to 256 tracks
+//   decode_notes    Amount of commands for the decoding benchmarks
+#define AIL_ALL_IMPL
+#define AIL_BUF_IMPL
+#define AIL_FS_IMPL
+#define AIL_TIME_IMPL
+#define MIDI_IMPL
+#include "ail.h"
+#include "ail_fs.h"
+#include "ail_buf.h"
+#include "ail_time.h"
+#include "common.h"
+#include "midi.c"
+#include "pidi.c"
+#include <stdio.h>
+#ifdef _WIN32
+#define PSAPI_VERSION 2 // Maps GetProcessMemoryInfo to K32GetProcessMemoryInfo, so that psapi doesn't need to be linked
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h> // For getrusage
+#endif
+
+#define BENCH_TOTAL_CMDS  (1 << 20)
+#define BENCH_MAX_TRACKS  256
+#define BENCH_OUT_FILE    "bench_midi_out.mid"
+#define BENCH_PIDI_FILE   "bench_midi_out.pidi"
+
+typedef struct BenchSmfConfig {
+    u32  tracks;
+    u32  notes;
+    u32  density;
+    u32  tempo_changes;
+    u32  meta_noise;
+    bool running_status;
+    u32  reps;
+    bool merge_sweep;
+    u32  decode_notes;
+} BenchSmfConfig;
+
+static u64 bench_rand_state = 0x2545F4914F6CDD1DULL;
+
+// xorshift64, so that every run benchmarks the exact same input
+static inline u32 bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return (u32)bench_rand_state;
+}
+
+// Peak resident memory of the whole process in KB
+u64 bench_peak_rss_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss; // Already in KB on Linux
+#endif
+}
+
+static inline void bench_write_var_len(AIL_Buffer *buffer, u32 x)
+{
+    u8  bytes[5];
+    u32 n = 0;
+    do {
+        bytes[n++] = x & 0x7f;
+        x >>= 7;
+    } while (x);
+    while (n-- > 1) ail_buf_write1(buffer, bytes[n] | 0x80);
+    ail_buf_write1(buffer, bytes[0]);
+}
+
+static inline void bench_write_track_header(AIL_Buffer *buffer, u64 *len_idx)
+{
+    ail_buf_write4msb(buffer, 0x4D54726B); // MTrk
+    *len_idx     = buffer->idx;
+    buffer->idx += 4;
+}
+
+static inline void bench_write_track_end(AIL_Buffer *buffer, u64 len_idx)
+{
+    ail_buf_write4msb(buffer, 0x00ff2f00);
+    u64 cur_idx = buffer->idx;
+    buffer->idx = len_idx;
+    ail_buf_write4msb(buffer, cur_idx - (len_idx + 4));
+    buffer->idx = cur_idx;
+}
+
+// Generates a format 1 SMF according to config
+// events is set to the amount of events in the file
+AIL_Buffer bench_gen_smf(BenchSmfConfig config, u64 *events)
+{
+    const u16 ticksPQN = 480;
+    AIL_Buffer buffer  = ail_buf_new(64 + config.tempo_changes*8 + (u64)config.tracks*(16 + config.notes*(12 + config.meta_noise/2)));
+    *events = 0;
+    ail_buf_write4msb(&buffer, 0x4D546864); // MThd
+    ail_buf_write4msb(&buffer, 6);
+    ail_buf_write2msb(&buffer, 1);
+    ail_buf_write2msb(&buffer, config.tracks + 1);
+    ail_buf_write2msb(&buffer, ticksPQN);
+
+    // Conductor track, whose tempo changes are spread over the expected length of the note tracks
+    u64 len_idx;
+    bench_write_track_header(&buffer, &len_idx);
+    u32 song_ticks = (u64)config.notes*ticksPQN/AIL_MAX(config.density, 1);
+    u32 tempo_dt   = song_ticks/(config.tempo_changes + 1);
+    for (u32 i = 0; i < config.tempo_changes; i++) {
+        bench_write_var_len(&buffer, i ? tempo_dt : 0);
+        ail_buf_write3msb(&buffer, 0xff5103);
+        ail_buf_write3msb(&buffer, 300000 + bench_rand()%600000); // Between 200BPM and 67BPM
+    }
+    bench_write_track_end(&buffer, len_idx);
+    *events += config.tempo_changes + 1;
+
+    // Note tracks
+    // The note-off of a note directly follows its note-on, but with a delta_time of 0 for some notes and some note-ons, so that chords are generated as well
+    u32 max_gap = 2*ticksPQN/AIL_MAX(config.density, 1);
+    for (u32 t = 0; t < config.tracks; t++) {
+        bench_write_track_header(&buffer, &len_idx);
+        for (u32 i = 0; i < config.notes; i++) {
+            u32 r = bench_rand();
+            if (r%100 < config.meta_noise) {
+                static const char text[] = "Some lyrics, that the parser needs to skip";
+                u32 text_len = 1 + bench_rand()%(sizeof(text) - 1);
+                bench_write_var_len(&buffer, 0);
+                ail_buf_write2msb(&buffer, 0xff05);
+                bench_write_var_len(&buffer, text_len);
+                ail_buf_writestr(&buffer, text, text_len);
+                (*events)++;
+            }
+            u8 note     = 21 + (r >> 8)%88; // Range of a grand piano
+            u8 velocity = 1 + (r >> 16)%127;
+            bench_write_var_len(&buffer, (r >> 24)%2 ? 0 : bench_rand()%(max_gap + 1));
+            if (!config.running_status || i == 0) ail_buf_write1(&buffer, 0x90 | (t & 0x0f));
+            ail_buf_write1(&buffer, note);
+            ail_buf_write1(&buffer, velocity);
+            bench_write_var_len(&buffer, (r >> 25)%4 ? 1 + bench_rand()%ticksPQN : 0);
+            if (!config.running_status) ail_buf_write1(&buffer, 0x90 | (t & 0x0f));
+            ail_buf_write1(&buffer, note);
+            ail_buf_write1(&buffer, 0); // A note-on with a velocity of 0 is a note-off
+        }
+        bench_write_track_end(&buffer, len_idx);
+        *events += 2*config.notes + 1;
+    }
+    buffer.len = buffer.idx;
+    buffer.idx = 0;
+    return buffer;
+}
+
+static inline void bench_print(const char *name, u64 events, u64 bytes, f64 secs)
+{
+    printf("%s events=%llu bytes=%llu ms=%.3f events_per_s=%.0f mb_per_s=%.2f",
+           name, (unsigned long long)events, (unsigned long long)bytes, secs*1000.0, events/secs, bytes/secs/1e6);
+}
+
+// Times parse_midi on the generated file and write_midi on the parsed song
+void bench_parse_write(BenchSmfConfig config, AIL_Buffer smf, u64 events)
+{
+    f64 best = 0;
+    ParseMidiRes res = {0};
+    for (u32 rep = 0; rep < config.reps; rep++) {
+        f64 t = ail_time_clock_start();
+        res = parse_midi(smf, &ail_default_allocator);
+        f64 elapsed = ail_time_clock_elapsed(t);
+        AIL_ASSERT(res.succ);
+        if (rep + 1 < config.reps) ail_da_free(&res.val.song.cmds);
+        if (!rep || elapsed < best) best = elapsed;
+    }
+    bench_print("parse", events, smf.len, best);
+    printf(" scratch_bytes=%llu song_bytes=%llu peak_rss_kb=%llu\n",
+           (unsigned long long)res.stats.scratch, (unsigned long long)res.stats.song, (unsigned long long)bench_peak_rss_kb());
+
+    best = 0;
+    for (u32 rep = 0; rep < config.reps; rep++) {
+        f64 t = ail_time_clock_start();
+        write_midi(res.val.song, BENCH_OUT_FILE);
+        f64 elapsed = ail_time_clock_elapsed(t);
+        if (!rep || elapsed < best) best = elapsed;
+    }
+    u64  written = 0;
+    FMap out;
+    if (fmap_open(BENCH_OUT_FILE, &out)) {
+        written = out.len;
+        fmap_close(&out);
+    }
+    remove(BENCH_OUT_FILE);
+    bench_print("write", 2*(u64)res.val.song.cmds.len, written, best);
+    printf(" peak_rss_kb=%llu\n", (unsigned long long)bench_peak_rss_kb());
+    ail_da_free(&res.val.song.cmds);
+}
+
+// Times decoding the generated file with a MidiStream in blocks of CMDS_LIST_LEN cmds, like when streaming it to the piano
+// The streamed cmds need to be the same as the ones from parse_midi
+void bench_stream(BenchSmfConfig config, AIL_Buffer smf, u64 events)
+{
+    ParseMidiRes expected = parse_midi(smf, &ail_default_allocator);
+    AIL_ASSERT(expected.succ);
+    PidiCmd *cmds = malloc(((u64)expected.val.song.cmds.len + CMDS_LIST_LEN)*sizeof(PidiCmd));
+    char err[256];
+    f64  best = 0;
+    for (u32 rep = 0; rep < config.reps; rep++) {
+        f64 t = ail_time_clock_start();
+        MidiStream stream;
+        AIL_ASSERT(midi_stream_open(&stream, smf, err));
+        u32 len = 0, n;
+        do {
+            n    = midi_stream_next(&stream, &cmds[len], CMDS_LIST_LEN);
+            len += n;
+        } while (n == CMDS_LIST_LEN);
+        u64 song_len = stream.song_len;
+        midi_stream_close(&stream);
+        f64 elapsed = ail_time_clock_elapsed(t);
+        AIL_ASSERT(len == expected.val.song.cmds.len && song_len == expected.val.song.len);
+        for (u32 i = 0; i < len; i++) {
+            PidiCmd a = cmds[i], b = expected.val.song.cmds.data[i];
+            AIL_ASSERT(pidi_dt(a) == pidi_dt(b) && pidi_len(a) == pidi_len(b) && pidi_velocity(a) == pidi_velocity(b) &&
+                       pidi_octave(a) == pidi_octave(b) && pidi_key(a) == pidi_key(b));
+        }
+        if (!rep || elapsed < best) best = elapsed;
+    }
+    bench_print("stream", events, smf.len, best);
+    printf(" tracks=%u peak_rss_kb=%llu\n", config.tracks + 1, (unsigned long long)bench_peak_rss_kb());
+    ail_da_free(&expected.val.song.cmds);
+    free(cmds);
+}
+
+// Times merge_sorted_chunks on the tracks of the generated file, which are parsed beforehand
+void bench_merge_smf(BenchSmfConfig config, AIL_Buffer smf)
+{
+    char err[256];
+    MidiTempoMap tempo_map;
+    AIL_DA(MidiTrackChunk) track_chunks;
+    bool succ = midi_open(smf, &tempo_map, &track_chunks, err);
+    AIL_ASSERT(succ);
+    AIL_DA(PidiCmdList) chunks = ail_da_new_with_cap(PidiCmdList, track_chunks.len);
+    for (u32 i = 0; i < track_chunks.len; i++) {
+        PidiCmdList cmds = ail_da_new_with_cap(PidiCmd, AIL_MAX(track_chunks.data[i].notes, 1));
+        ail_da_push(&chunks, parse_midi_track(smf, track_chunks.data[i], &tempo_map, cmds));
+    }
+    u64 *start_times = malloc(chunks.len*sizeof(u64));
+    u64  cmds_count  = 0;
+    f64  best        = 0;
+    for (u32 rep = 0; rep < config.reps; rep++) {
+        memset(start_times, 0, chunks.len*sizeof(u64));
+        f64 t = ail_time_clock_start();
+        ParseMidiRes res = merge_sorted_chunks(chunks, start_times, &ail_default_allocator);
+        f64 elapsed = ail_time_clock_elapsed(t);
+        cmds_count = res.val.song.cmds.len;
+        ail_da_free(&res.val.song.cmds);
+        if (!rep || elapsed < best) best = elapsed;
+    }
+    bench_print("merge", cmds_count, cmds_count*sizeof(PidiCmd), best);
+    printf(" tracks=%u peak_rss_kb=%llu\n", chunks.len, (unsigned long long)bench_peak_rss_kb());
+
+    for (u32 i = 0; i < chunks.len; i++) ail_da_free(&chunks.data[i]);
+    ail_da_free(&chunks);
+    ail_da_free(&track_chunks);
+    ail_da_free(&tempo_map.segs);
+    free(start_times);
+}
+
+// Splits BENCH_TOTAL_CMDS random commands evenly across ntracks chunks
+AIL_DA(PidiCmdList) bench_gen_chunks(u32 ntracks)
+{
+    AIL_DA(PidiCmdList) chunks = ail_da_new_with_cap(PidiCmdList, ntracks);
+    u32 per_track = BENCH_TOTAL_CMDS / ntracks;
+    for (u32 i = 0; i < ntracks; i++) {
+        AIL_DA(PidiCmd) chunk = ail_da_new_with_cap(PidiCmd, per_track);
+        for (u32 j = 0; j < per_track; j++) {
+            u32 r = bench_rand();
+            PidiCmd cmd = {
+                .dt       = (r & 0xff) * ntracks / 16,
+                .velocity = (r >> 8) % MAX_VELOCITY,
+                .len      = (r >> 12) & 0x3f,
+                .octave   = (i8)((r >> 18) % 9) - 4,
+                .key      = (r >> 22) % PIANO_KEY_AMOUNT,
+            };
+            ail_da_push(&chunk, cmd);
+        }
+        ail_da_push(&chunks, chunk);
+    }
+    return chunks;
+}
+
+void bench_merge(u32 ntracks, u32 reps)
+{
+    AIL_DA(PidiCmdList) chunks = bench_gen_chunks(ntracks);
+    u64 *start_times = malloc(ntracks * sizeof(u64));
+    f64 best = 0;
+    for (u32 rep = 0; rep < reps; rep++) {
+        memset(start_times, 0, ntracks * sizeof(u64));
+        f64 t = ail_time_clock_start();
+        ParseMidiRes res = merge_sorted_chunks(chunks, start_times, &ail_default_allocator);
+        f64 elapsed = ail_time_clock_elapsed(t);
+        AIL_ASSERT(res.succ);
+        ail_da_free(&res.val.song.cmds);
+        if (!rep || elapsed < best) best = elapsed;
+    }
+    u32 log_tracks = 0;
+    while ((1u << log_tracks) < ntracks) log_tracks++;
+    f64 ns_per_cmd = best * 1e9 / (f64)BENCH_TOTAL_CMDS;
+    printf("merge_sweep tracks=%u cmds=%u ms=%.3f ns_per_cmd=%.2f ns_per_cmd_per_log2_tracks=%.2f\n",
+           ntracks, BENCH_TOTAL_CMDS, best * 1000.0, ns_per_cmd, ns_per_cmd / (f64)AIL_MAX(log_tracks, 1));
+
+    for (u32 i = 0; i < chunks.len; i++) ail_da_free(&chunks.data[i]);
+    ail_da_free(&chunks);
+    free(start_times);
+}
+
+// Times decoding n random commands one by one with decode_cmd, all at once with pidi_decode_cmds and loading them from a current .pidi file
+void bench_decode(u32 n, u32 reps)
+{
+    AIL_DA(PidiCmdList) chunks = bench_gen_chunks(1);
+    PidiCmd   *cmds    = malloc((u64)n*sizeof(PidiCmd));
+    PidiCmd   *decoded = malloc((u64)n*sizeof(PidiCmd));
+    AIL_Buffer encoded = ail_buf_new((u64)n*ENCODED_CMD_LEN);
+    for (u32 i = 0; i < n; i++) {
+        cmds[i] = chunks.data[0].data[i % chunks.data[0].len];
+        encode_cmd(&encoded, cmds[i]);
+    }
+    f64 best[3] = { 0 };
+    for (u32 rep = 0; rep < reps; rep++) {
+        for (u32 kind = 0; kind < 3; kind++) {
+            f64 t = ail_time_clock_start();
+            switch (kind) {
+                case 0:
+                    encoded.idx = 0;
+                    for (u32 i = 0; i < n; i++) decoded[i] = decode_cmd(&encoded);
+                    break;
+                case 1:
+                    pidi_decode_cmds(encoded.data, decoded, n);
+                    break;
+                case 2: {
+                    // The file is written outside of the timed part
+                    t = 0;
+                    AIL_Buffer file = pidi_encode(cmds, n, false);
+                    AIL_ASSERT(ail_buf_to_file(&file, BENCH_PIDI_FILE));
+                    free(file.data);
+                    AIL_DA(PidiCmd) loaded;
+                    PidiIndex index;
+                    t = ail_time_clock_start();
+                    AIL_ASSERT(pidi_load(BENCH_PIDI_FILE, &loaded, &index));
+                    // Touch every command, since the mapped file is only read when being used
+                    u64 sum = 0;
+                    for (u32 i = 0; i < n; i++) sum += pidi_dt(loaded.data[i]);
+                    AIL_ASSERT(sum || !n);
+                    pidi_index_free(&index);
+                    ail_da_free(&loaded);
+                } break;
+            }
+            f64 elapsed = ail_time_clock_elapsed(t);
+            if (!rep || elapsed < best[kind]) best[kind] = elapsed;
+        }
+    }
+    remove(BENCH_PIDI_FILE);
+    printf("decode cmds=%u per_cmd_ms=%.3f batch_ms=%.3f load_mapped_ms=%.3f batch_speedup=%.2f\n",
+           n, best[0]*1000.0, best[1]*1000.0, best[2]*1000.0, best[0]/best[1]);
+
+    for (u32 i = 0; i < chunks.len; i++) ail_da_free(&chunks.data[i]);
+    ail_da_free(&chunks);
+    free(encoded.data);
+    free(cmds);
+    free(decoded);
+}
+
+int main(int argc, char **argv)
+{
+    BenchSmfConfig config = {
+        .tracks         = 16,
+        .notes          = 100000,
+        .density        = 4,
+        .tempo_changes  = 64,
+        .meta_noise     = 2,
+        .running_status = true,
+        .reps           = 5,
+        .merge_sweep    = false,
+        .decode_notes   = 500000,
+    };
+    for (i32 i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (!eq) goto usage;
+        *eq = 0;
+        u32 val = strtoul(eq + 1, NULL, 10);
+        if      (!strcmp(argv[i], "tracks"))         config.tracks         = AIL_CLAMP(val, 1, UINT16_MAX - 1);
+        else if (!strcmp(argv[i], "notes"))          config.notes          = val;
+        else if (!strcmp(argv[i], "density"))        config.density        = val;
+        else if (!strcmp(argv[i], "tempo_changes"))  config.tempo_changes  = val;
+        else if (!strcmp(argv[i], "meta_noise"))     config.meta_noise     = AIL_MIN(val, 100);
+        else if (!strcmp(argv[i], "running_status")) config.running_status = val;
+        else if (!strcmp(argv[i], "reps"))           config.reps           = AIL_MAX(val, 1);
+        else if (!strcmp(argv[i], "merge_sweep"))    config.merge_sweep    = val;
+        else if (!strcmp(argv[i], "decode_notes"))   config.decode_notes   = val;
+        else goto usage;
+    }
+
+    printf("config tracks=%u notes=%u density=%u tempo_changes=%u meta_noise=%u running_status=%u reps=%u\n",
+           config.tracks, config.notes, config.density, config.tempo_changes, config.meta_noise, config.running_status, config.reps);
+    u64 events;
+    AIL_Buffer smf = bench_gen_smf(config, &events);
+    bench_parse_write(config, smf, events);
+    bench_merge_smf(config, smf);
+    bench_stream(config, smf, events);
+    free(smf.data);
+    bench_decode(config.decode_notes, config.reps);
+
+    if (config.merge_sweep) {
+        for (u32 ntracks = 1; ntracks <= BENCH_MAX_TRACKS; ntracks *= 2) {
+            bench_merge(ntracks, config.reps);
+        }
+    }
+    return 0;
+
+usage:
+    printf("USAGE: %s [tracks=N] [notes=N] [density=N] [tempo_changes=N] [meta_noise=PERCENT] [running_status=0|1] [reps=N] [merge_sweep=0|1] [decode_notes=N]\n", argv[0]);
+    return 1;
+}
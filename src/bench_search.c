@@ -0,0 +1,209 @@
+// Benchmarks for searching the song library
+// Generates deterministic libraries of song names and times substring queries on them with:
+//   naive:   The original search, which compares the query with is_prefix at every position of every name, case-folding both on the fly
+//   scalar:  A scan over the case-folded names, comparing byte by byte
+//   simd:    The same scan with the vectorized kernel of search.c (identical to scalar, if SSE2 is not available)
+//   trigram: search_substrings with the trigram index of search.c, which also ranks the results
+// Additionally times search_fuzzy on queries with typos
+// Every result is printed as a single line of `key=value` pairs, so that the output can be compared between versions by scripts
+//
+// Usage: bench_search [key=value ...]
+// Keys:
+//   songs  Amount of songs in the library (default: 10000, 100000 and 1000000 one after another)
+//   reps   Amount of repetitions per benchmark (the fastest one is reported)
+#define AIL_ALL_IMPL
+#define AIL_BUF_IMPL
+#define AIL_FS_IMPL
+#define AIL_TIME_IMPL
+#include "ail.h"
+#include "ail_fs.h"
+#include "ail_buf.h"
+#include "ail_time.h"
+#include "common.h"
+#include "search.c"
+#include <stdio.h>
+
+static const char *bench_words[] = {
+    "Moonlight", "Sonata", "Nocturne", "Prelude", "Fugue", "Etude", "Waltz", "Ballade", "Impromptu", "Rhapsody",
+    "Concerto", "Symphony", "Variations", "Suite", "Minuet", "March", "Fantasia", "Toccata", "Scherzo", "Polonaise",
+    "in", "of", "the", "for", "and", "No.", "Op.", "Major", "Minor", "Flat", "Sharp", "Piano",
+    "Chopin", "Beethoven", "Mozart", "Bach", "Liszt", "Debussy", "Satie", "Schubert", "Brahms", "Ravel",
+    "Clair", "de", "Lune", "Gymnopedie", "Arabesque", "Reverie", "Elise", "Spring", "Winter", "Night",
+};
+static const char *bench_queries[] = { "a", "so", "lune", "op. 2", "nocturne in", "beethoven", "xyz" };
+static const char *bench_fuzzy_queries[] = { "lnue", "beethovn", "noctrune in", "moonlite sonata" };
+
+static u64 bench_rand_state = 0x2545F4914F6CDD1DULL;
+
+// xorshift64, so that every run benchmarks the exact same input
+static inline u32 bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return (u32)bench_rand_state;
+}
+
+// Generates names of 2 to 6 random words followed by a number, so that all names are unique
+AIL_DA(Song) bench_gen_library(u32 n)
+{
+    AIL_DA(Song) library = ail_da_new_with_cap(Song, n);
+    library_reserve_names((u64)n*64);
+    char name[256];
+    for (u32 i = 0; i < n; i++) {
+        u32 len   = 0;
+        u32 words = 2 + bench_rand()%5;
+        for (u32 w = 0; w < words; w++) {
+            const char *word = bench_words[bench_rand() % (sizeof(bench_words)/sizeof(*bench_words))];
+            u32 word_len     = strlen(word);
+            memcpy(&name[len], word, word_len);
+            len += word_len;
+            name[len++] = ' ';
+        }
+        len += sprintf(&name[len], "%u", i);
+        Song song = { .name = library_intern(name, len, NULL) };
+        ail_da_push(&library, song);
+    }
+    return library;
+}
+
+bool bench_is_prefix(const char *restrict prefix, const char *restrict str)
+{
+    bool is_prefix = true;
+    u32 i = 0;
+    for (; str[i] && prefix[i] && is_prefix; i++) {
+        char c1 = str[i];
+        char c2 = prefix[i];
+        if (str[i]    >= 'A' && str[i]    <= 'Z') c1 += 'a' - 'A';
+        if (prefix[i] >= 'A' && prefix[i] <= 'Z') c2 += 'a' - 'A';
+        is_prefix = c1 == c2;
+    }
+    return is_prefix && !prefix[i];
+}
+
+// The original search_songs, but only counting the songs that contain the query without starting with it
+u32 bench_naive(AIL_DA(Song) library, const char *query)
+{
+    u32 matches = 0;
+    u32 query_len = strlen(query);
+    for (u32 i = 0; i < library.len; i++) {
+        if (bench_is_prefix(query, library.data[i].name)) continue;
+        bool is_substr = false;
+        u32 name_len = strlen(library.data[i].name);
+        if (name_len > query_len) {
+            for (u32 j = 1; !is_substr && j <= name_len - query_len; j++) {
+                is_substr = bench_is_prefix(query, &library.data[i].name[j]);
+            }
+        }
+        matches += is_substr;
+    }
+    return matches;
+}
+
+u32 bench_scalar(AIL_DA(Song) library, const char *query)
+{
+    u32 matches = 0;
+    u32 query_len = strlen(query);
+    for (u32 i = 0; i < library.len; i++) {
+        const char *name = library_name_folded(library.data[i].name);
+        matches += search_substr_pos_scalar(name, library_name_len(library.data[i].name), query, query_len) > 0;
+    }
+    return matches;
+}
+
+u32 bench_simd(AIL_DA(Song) library, const char *query)
+{
+    u32 matches = 0;
+    u32 query_len = strlen(query);
+    for (u32 i = 0; i < library.len; i++) {
+        const char *name = library_name_folded(library.data[i].name);
+        matches += search_substr_pos(name, library_name_len(library.data[i].name), query, query_len) > 0;
+    }
+    return matches;
+}
+
+void bench_library(u32 n, u32 reps)
+{
+    AIL_DA(Song) library = bench_gen_library(n);
+    u64 name_bytes = 0;
+    for (u32 i = 0; i < library.len; i++) name_bytes += library_name_len(library.data[i].name);
+    char **names = malloc(n*sizeof(char *));
+    for (u32 i = 0; i < n; i++) names[i] = library.data[i].name;
+    f64 t = ail_time_clock_start();
+    SearchTrigrams index = search_trigrams_build(names, n);
+    printf("trigram_build songs=%u ms=%.3f grams=%u postings=%u\n", n, ail_time_clock_elapsed(t)*1000.0, index.grams.len, index.songs.len);
+
+    AIL_DA(u32) out = ail_da_new(u32);
+    for (u32 q = 0; q < sizeof(bench_queries)/sizeof(*bench_queries); q++) {
+        const char *query = bench_queries[q];
+        f64 best[4] = { 0 };
+        u32 matches[4] = { 0 };
+        for (u32 rep = 0; rep < reps; rep++) {
+            for (u32 kind = 0; kind < 4; kind++) {
+                f64 t = ail_time_clock_start();
+                switch (kind) {
+                    case 0: matches[kind] = bench_naive(library, query);  break;
+                    case 1: matches[kind] = bench_scalar(library, query); break;
+                    case 2: matches[kind] = bench_simd(library, query);   break;
+                    case 3:
+                        out.len = 0;
+                        search_substrings(&index, library, query, strlen(query), &out);
+                        matches[kind] = out.len;
+                        break;
+                }
+                f64 elapsed = ail_time_clock_elapsed(t);
+                if (!rep || elapsed < best[kind]) best[kind] = elapsed;
+            }
+        }
+        AIL_ASSERT(matches[0] == matches[1] && matches[1] == matches[2] && matches[2] == matches[3]);
+        printf("query songs=%u name_bytes=%llu query=\"%s\" matches=%u naive_ms=%.3f scalar_ms=%.3f simd_ms=%.3f trigram_ms=%.3f simd_speedup=%.2f\n",
+               n, (unsigned long long)name_bytes, query, matches[0], best[0]*1000.0, best[1]*1000.0, best[2]*1000.0, best[3]*1000.0, best[0]/best[2]);
+    }
+    for (u32 q = 0; q < sizeof(bench_fuzzy_queries)/sizeof(*bench_fuzzy_queries); q++) {
+        const char *query = bench_fuzzy_queries[q];
+        f64 best = 0;
+        for (u32 rep = 0; rep < reps; rep++) {
+            out.len = 0;
+            f64 t = ail_time_clock_start();
+            search_fuzzy(library, query, strlen(query), &out);
+            f64 elapsed = ail_time_clock_elapsed(t);
+            if (!rep || elapsed < best) best = elapsed;
+        }
+        printf("fuzzy songs=%u query=\"%s\" errors=%u matches=%u ms=%.3f\n", n, query, search_fuzzy_max_errors(strlen(query)), out.len, best*1000.0);
+    }
+    ail_da_free(&out);
+    search_trigrams_free(&index);
+    free(names);
+    ail_da_free(&library);
+}
+
+int main(int argc, char **argv)
+{
+    u32 songs = 0;
+    u32 reps  = 5;
+    for (i32 i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (!eq) goto usage;
+        *eq = 0;
+        u32 val = strtoul(eq + 1, NULL, 10);
+        if      (!strcmp(argv[i], "songs")) songs = AIL_MAX(val, 1);
+        else if (!strcmp(argv[i], "reps"))  reps  = AIL_MAX(val, 1);
+        else goto usage;
+    }
+
+#ifdef SEARCH_SSE2
+    printf("config simd=sse2 reps=%u\n", reps);
+#else
+    printf("config simd=none reps=%u\n", reps);
+#endif
+    if (songs) {
+        bench_library(songs, reps);
+    } else {
+        for (u32 n = 10000; n <= 1000000; n *= 10) bench_library(n, reps);
+    }
+    return 0;
+
+usage:
+    printf("USAGE: %s [songs=N] [reps=N]\n", argv[0]);
+    return 1;
+}
@@ -11,6 +11,7 @@
 #include "ail_time.h"
 #include "ail_alloc.h"
 #include "common.h"
+#include "pidi.c"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,7 +31,6 @@ typedef struct NextMsgRing {
     u8 end;
 } NextMsgRing;
 AIL_STATIC_ASSERT(NEXT_MSGS_COUNT <= UINT8_MAX);
-AIL_DA_INIT(MsgPidiPlayedKey);
 
 // @Note: All communication with the Arduino is done in a single thread external from the UI's main thread.
 // No other thread should write to these variables
@@ -47,6 +47,8 @@ static f64   last_comm_time        = 0.0f;  // Timestamp of last received messag
 static ClientMsg comm_last_sent    = { 0 }; // Last message that was sent to the Arduino
 static AIL_RingBuffer comm_rb      = { 0 };
 static AIL_DA(PidiCmd) comm_cmds   = { 0 };
+static PidiIndex comm_index        = { 0 };
+static u32   comm_song_gen         = 0;     // Incremented by every call to send_new_song, to tell apart the songs it was called with
 static NextMsgRing comm_next_msgs  = { 0 };
 static AIL_DA(MsgPidiPlayedKey) comm_played_keys = { 0 };
 
@@ -55,7 +57,9 @@ static pthread_mutex_t comm_speed_mutex  = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t comm_song_mutex   = PTHREAD_MUTEX_INITIALIZER;
 
 // For writing to the communication thread, the main thread should call the following functions
-void send_new_song(AIL_DA(PidiCmd) cmds, u32 start_time);
+u32  send_new_song(AIL_DA(PidiCmd) cmds, PidiIndex index, u32 start_time);
+bool append_song_cmds(u32 song, const PidiCmd *cmds, u32 n);
+void seek_song(u32 time);
 void set_volume(f32 volume);
 void set_speed(f32 speed);
 
@@ -102,6 +106,8 @@ void *comm_thread_main(void *args)
         // Send any queued up messages
         ClientMsgType next_msg;
         while (comm_is_connected && comm_last_sent.type == CMSG_NONE && (next_msg = pop_msg())) {
+            // The song is locked while sending, since append_song_cmds might move comm_cmds.data
+            while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
             ClientMsg msg;
             switch (next_msg) {
                 case CMSG_NONE:
@@ -131,22 +137,8 @@ void *comm_thread_main(void *args)
                     comm_ignore_reqps = true;
                     if (next_msgs_contain_pidi()) goto skip_sending_message;
 
-                    u32 i = 0;
-                    u32 prev_cmd_time = 0;
-                    for (; i < comm_cmds.len && prev_cmd_time + comm_cmds.data[i].dt < comm_time; i++) {
-                        PidiCmd cmd  = comm_cmds.data[i];
-                        u32 end_time = prev_cmd_time + cmd.dt + cmd.len*LEN_FACTOR;
-                        if (comm_time < end_time) {
-                            MsgPidiPlayedKey pk = {
-                                .key      = cmd.key,
-                                .octave   = cmd.octave,
-                                .len      = (end_time - comm_time)/LEN_FACTOR,
-                                .velocity = cmd.velocity,
-                            };
-                            ail_da_push(&comm_played_keys, pk);
-                        }
-                        prev_cmd_time += cmd.dt;
-                    }
+                    comm_played_keys.len = 0;
+                    u32 i = pidi_index_seek(&comm_index, comm_cmds.data, comm_cmds.len, comm_time, &comm_played_keys);
                     ClientMsgPidiData pidi = {
                         .time        = comm_time,
                         .cmds_count  = AIL_MIN(comm_cmds.len - i, CMDS_LIST_LEN),
@@ -164,7 +156,7 @@ void *comm_thread_main(void *args)
             }
             comm_is_connected = send_msg(msg);
 skip_sending_message:
-            AIL_UNUSED(0); // to allow the label `skip_sending_message` to exist here
+            while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
         }
 
         // Read data from port into ring buffer
@@ -241,16 +233,51 @@ bool next_msgs_contain_pidi(void)
     return false;
 }
 
-void send_new_song(AIL_DA(PidiCmd) cmds, u32 start_time)
+// The communication thread takes ownership of cmds and index
+// If index is not complete yet (i.e. for a song that is still being decoded), it is extended here
+// Returns the generation of the song, which is needed for appending commands to it
+u32 send_new_song(AIL_DA(PidiCmd) cmds, PidiIndex index, u32 start_time)
 {
     while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
     // printf("\033[33mSENDING NEW SONG at time %f\033[0m\n", start_time);
+    // The index might point into the same mapping as the commands, so it is freed first
+    if (comm_index.blocks.data) pidi_index_free(&comm_index);
     if (comm_cmds.data) ail_da_free(&comm_cmds);
     comm_pidi_chunk_idx = 0;
-    comm_time = start_time;
-    comm_cmds = cmds;
+    comm_time  = start_time;
+    comm_cmds  = cmds;
+    comm_index = index;
+    pidi_index_extend(&comm_index, comm_cmds.data, comm_cmds.len);
+    u32 gen = ++comm_song_gen;
     push_msg(CMSG_PIDI);
     while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
+    return gen;
+}
+
+// Restarts the current song at time (i.e. when jumping on the timeline)
+void seek_song(u32 time)
+{
+    while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
+    comm_pidi_chunk_idx = 0;
+    comm_time = time;
+    push_msg(CMSG_PIDI);
+    while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
+}
+
+// Appends cmds to the end of the song with the generation returned by send_new_song
+// Used for sending a song to the Arduino, while it is still being decoded
+// Returns false without appending anything, if another song was sent since then (its commands might not even be appendable, i.e. if they are cached by the loader)
+// @Note: If the Arduino requests the next chunk before it was appended, the song ends early
+bool append_song_cmds(u32 song, const PidiCmd *cmds, u32 n)
+{
+    while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
+    bool is_current = song == comm_song_gen;
+    if (is_current) {
+        ail_da_pushn(&comm_cmds, cmds, n);
+        pidi_index_extend(&comm_index, comm_cmds.data, comm_cmds.len);
+    }
+    while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
+    return is_current;
 }
 
 void set_paused(bool paused)
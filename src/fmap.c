@@ -0,0 +1,101 @@
+// Read-only memory-mapped files
+// Used to give parsers a view of a file's content without reading it into a heap-allocated copy first
+#ifndef FMAP_C_
+#define FMAP_C_
+
+#include "ail.h"
+#include "ail_buf.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>    // For open
+#include <unistd.h>   // For close
+#include <sys/mman.h> // For mmap, munmap
+#include <sys/stat.h> // For fstat
+#endif
+
+typedef struct FMap {
+    u8  *data; // Read-only - writing to it is undefined behaviour
+    u64  len;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} FMap;
+
+bool fmap_open(const char *fpath, FMap *map);
+void fmap_close(FMap *map);
+static inline AIL_Buffer fmap_to_buf(FMap map);
+
+// Returns false if the file couldn't be opened or mapped
+// An empty file is mapped successfully with map->data == NULL
+bool fmap_open(const char *fpath, FMap *map)
+{
+    *map = (FMap){0};
+#ifdef _WIN32
+    map->file = CreateFileA(fpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size)) goto failed;
+    map->len = size.QuadPart;
+    if (!map->len) return true;
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map->mapping) goto failed;
+    map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!map->data) {
+        CloseHandle(map->mapping);
+        goto failed;
+    }
+    return true;
+failed:
+    CloseHandle(map->file);
+    *map = (FMap){0};
+    return false;
+#else
+    int fd = open(fpath, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    map->len = st.st_size;
+    if (map->len) {
+        void *data = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            *map = (FMap){0};
+            return false;
+        }
+        map->data = data;
+    }
+    close(fd); // The mapping stays valid after closing the file descriptor
+    return true;
+#endif
+}
+
+void fmap_close(FMap *map)
+{
+#ifdef _WIN32
+    if (map->data) UnmapViewOfFile(map->data);
+    if (map->mapping) CloseHandle(map->mapping);
+    if (map->file) CloseHandle(map->file);
+#else
+    if (map->data) munmap(map->data, map->len);
+#endif
+    *map = (FMap){0};
+}
+
+// Creates a buffer for reading from the mapped file
+// The buffer must not be written to or freed
+static inline AIL_Buffer fmap_to_buf(FMap map)
+{
+    return (AIL_Buffer) {
+        .data = map.data,
+        .idx  = 0,
+        .len  = map.len,
+        .cap  = map.len,
+    };
+}
+
+#endif // FMAP_C_
@@ -0,0 +1,521 @@
+// Storage of the song library
+//
+// The library is stored as a snapshot and a journal, so that adding a song doesn't require rewriting the whole library
+// Layout of the snapshot (all integers are little-endian, except for the magic):
+//   u32 PDIL_MAGIC
+//   u32 LIBRARY_VERSION_FLAG | LIBRARY_VERSION (missing in version 1)
+//   u32 amount of songs
+//   for each song: u32 name length, u64 song length, SongMeta (missing in version 1), name (without null-terminator)
+// Layout of the journal:
+//   u32 LIBRARY_JOURNAL_MAGIC
+//   for each record: u8 LibraryRecordType, u32 payload length, payload
+//     LIBRARY_RECORD_ADD:    u32 name length, u64 song length, name, SongMeta (missing in records from version 1)
+//     LIBRARY_RECORD_RENAME: u32 old name length, old name, u32 new name length, new name
+//     LIBRARY_RECORD_DELETE: u32 name length, name
+// When loading the library, the journal is replayed on top of the snapshot
+// Once the journal has more records than the last snapshot has songs, it is compacted into a new snapshot,
+// which keeps the cost of writing the snapshot at O(1) per record
+// Replaying is idempotent, so that a crash between writing the new snapshot and clearing the journal loses nothing
+// A torn record at the end of the journal (i.e. from a crash while appending it) is removed by compacting when loading,
+// since records appended after it would otherwise be read as part of its payload
+//
+// The names of all songs are interned into a chunked arena, so that walking over the library walks over memory sequentially
+// Each name is stored as `SongMeta, u32 length, name, 0, case-folded name, 0` and is padded to a multiple of 8 bytes
+// Song.name points to the name inside the arena, so that the metadata, length and case-folded name can be found without another allocation
+// Chunks are never moved or freed, so that these pointers stay valid for the lifetime of the program (i.e. in the loader's cache)
+#ifndef LIBRARY_C_
+#define LIBRARY_C_
+
+#include "ail.h"
+#include "ail_buf.h"
+#include "common.h"
+#include "fmap.c"
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define LIBRARY_JOURNAL_MAGIC       0x5044494A // 'PDIJ'
+#define LIBRARY_RECORD_HEADER_SIZE  5
+#define LIBRARY_COMPACT_MIN_RECORDS 64 // The journal is never compacted before reaching this amount of records
+#define LIBRARY_NAME_CHUNK_SIZE     4096 // Minimum size of a chunk in the name arena
+#define LIBRARY_NAME_SLACK          16   // Zeroed bytes after each chunk, so that vectorized search can load 16 bytes at any position of a name
+#define LIBRARY_VERSION_FLAG        0x80000000 // Set in the version of the snapshot, to differentiate it from the amount of songs in version 1
+#define LIBRARY_VERSION             2
+#define LIBRARY_DENSITY_BINS        16
+#define LIBRARY_META_SIZE           (16 + 4 + LIBRARY_DENSITY_BINS) // Size of a serialized SongMeta
+
+typedef enum LibraryRecordType {
+    LIBRARY_RECORD_ADD = 1,
+    LIBRARY_RECORD_RENAME,
+    LIBRARY_RECORD_DELETE,
+} LibraryRecordType;
+
+// Hash map from song names to their index in the library, used for replaying the journal in O(records)
+// Songs deleted while replaying keep their slot, but have their name set to NULL
+typedef struct LibraryNameMap {
+    u32 *slots; // Index of the song + 1, or 0 for empty slots
+    u32  cap;   // Power of 2
+} LibraryNameMap;
+
+// Metadata of a song, that is computed once when importing it, so that the UI doesn't need to load the song to show it
+// All fields are 0 for songs, that were imported before the metadata existed
+typedef struct SongMeta {
+    u64 hash;          // FNV-1a hash of the commands
+    u32 notes;         // Amount of notes
+    u32 cmds_size;     // Size of the commands in memory in bytes
+    u16 max_polyphony; // Maximum amount of notes held at the same time
+    u8  min_key;       // Lowest piano index that is played
+    u8  max_key;       // Highest piano index that is played
+    u8  density[LIBRARY_DENSITY_BINS]; // Amount of notes started in each slice of the song, scaled so that the fullest slice is 255
+} SongMeta;
+
+typedef struct LibraryNameArena {
+    char *chunk; // Chunk that new names are interned into. Previous chunks are kept alive by the names pointing into them
+    u32   len;
+    u32   cap;
+} LibraryNameArena;
+
+typedef struct LibraryFiles {
+    const char *snapshot_path;
+    const char *journal_path;
+    u32 journal_records; // Amount of records in the journal since the last compaction
+    u32 snapshot_songs;  // Amount of songs in the last snapshot
+} LibraryFiles;
+
+AIL_DA(Song) library_load(LibraryFiles *files);
+SongMeta library_song_meta(Song song);
+bool library_add(AIL_DA(Song) *library, Song song, const SongMeta *meta, LibraryFiles *files);
+bool library_rename(AIL_DA(Song) *library, u32 idx, char *new_name, LibraryFiles *files);
+bool library_delete(AIL_DA(Song) *library, u32 idx, LibraryFiles *files);
+bool library_compact(AIL_DA(Song) library, LibraryFiles *files);
+char *library_intern(const char *name, u32 name_len, const SongMeta *meta);
+static inline u32 library_name_len(const char *name);
+static inline const char *library_name_folded(const char *name);
+static inline const SongMeta *library_song_meta_of(const char *name);
+
+// Internal only functions
+static u32  library_hash(const char *name, u32 name_len);
+static i32  library_map_find(LibraryNameMap map, AIL_DA(Song) library, const char *name, u32 name_len);
+static void library_map_insert(LibraryNameMap *map, const char *name, u32 name_len, u32 idx);
+static inline u32 library_name_size(u32 name_len);
+static void  library_reserve_names(u64 size);
+static char *library_read_name(AIL_Buffer *buf, u32 name_len, const SongMeta *meta);
+static void  library_write_meta(AIL_Buffer *buf, const SongMeta *meta);
+static SongMeta library_read_meta(AIL_Buffer *buf);
+static bool library_append_record(LibraryFiles *files, LibraryRecordType type, AIL_Buffer payload);
+static bool library_maybe_compact(AIL_DA(Song) library, LibraryFiles *files);
+
+static LibraryNameArena library_names = { 0 };
+
+// Length of a name, that was interned with library_intern
+static inline u32 library_name_len(const char *name)
+{
+    return ((const u32 *)name)[-1];
+}
+
+// Lowercase copy of a name, that was interned with library_intern
+static inline const char *library_name_folded(const char *name)
+{
+    return &name[library_name_len(name) + 1];
+}
+
+// Metadata of a song, whose name was interned with library_intern
+static inline const SongMeta *library_song_meta_of(const char *name)
+{
+    return (const SongMeta *)(name - 4 - sizeof(SongMeta));
+}
+
+// Size of an interned name in the arena
+static inline u32 library_name_size(u32 name_len)
+{
+    return (sizeof(SongMeta) + 4 + 2*(name_len + 1) + 7) & ~7u;
+}
+
+// Makes sure, that the next size bytes of interned names fit into the current chunk
+static void library_reserve_names(u64 size)
+{
+    if (library_names.len + size <= library_names.cap) return;
+    library_names.cap   = AIL_MAX(size, LIBRARY_NAME_CHUNK_SIZE);
+    library_names.len   = 0;
+    library_names.chunk = malloc(library_names.cap + LIBRARY_NAME_SLACK);
+    memset(&library_names.chunk[library_names.cap], 0, LIBRARY_NAME_SLACK);
+}
+
+// Copies name and meta (if not NULL) into the name arena and returns the null-terminated copy of name
+char *library_intern(const char *name, u32 name_len, const SongMeta *meta)
+{
+    u32 size = library_name_size(name_len);
+    library_reserve_names(size);
+    char *entry = &library_names.chunk[library_names.len];
+    library_names.len += size;
+    SongMeta zero = { 0 };
+    memcpy(entry, meta ? meta : &zero, sizeof(SongMeta));
+    entry += sizeof(SongMeta);
+    memcpy(entry, &name_len, 4);
+    char *interned = &entry[4];
+    memcpy(interned, name, name_len);
+    interned[name_len] = 0;
+    char *folded = &interned[name_len + 1];
+    for (u32 i = 0; i < name_len; i++) folded[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 'a' - 'A' : name[i];
+    folded[name_len] = 0;
+    return interned;
+}
+
+// FNV-1a
+static u32 library_hash(const char *name, u32 name_len)
+{
+    u32 hash = 2166136261u;
+    for (u32 i = 0; i < name_len; i++) hash = (hash ^ (u8)name[i])*16777619u;
+    return hash;
+}
+
+static i32 library_map_find(LibraryNameMap map, AIL_DA(Song) library, const char *name, u32 name_len)
+{
+    for (u32 i = library_hash(name, name_len) & (map.cap - 1); map.slots[i]; i = (i + 1) & (map.cap - 1)) {
+        const char *other = library.data[map.slots[i] - 1].name;
+        if (other && library_name_len(other) == name_len && !memcmp(other, name, name_len)) return map.slots[i] - 1;
+    }
+    return -1;
+}
+
+// The map must have enough capacity left
+static void library_map_insert(LibraryNameMap *map, const char *name, u32 name_len, u32 idx)
+{
+    u32 i = library_hash(name, name_len) & (map->cap - 1);
+    while (map->slots[i]) i = (i + 1) & (map->cap - 1);
+    map->slots[i] = idx + 1;
+}
+
+// Interns the next name_len bytes of buf
+static char *library_read_name(AIL_Buffer *buf, u32 name_len, const SongMeta *meta)
+{
+    char *name = library_intern((char *)&buf->data[buf->idx], name_len, meta);
+    buf->idx += name_len;
+    return name;
+}
+
+static void library_write_meta(AIL_Buffer *buf, const SongMeta *meta)
+{
+    ail_buf_write8lsb(buf, meta->hash);
+    ail_buf_write4lsb(buf, meta->notes);
+    ail_buf_write4lsb(buf, meta->cmds_size);
+    ail_buf_write2lsb(buf, meta->max_polyphony);
+    ail_buf_write1(buf, meta->min_key);
+    ail_buf_write1(buf, meta->max_key);
+    ail_buf_writestr(buf, (const char *)meta->density, LIBRARY_DENSITY_BINS);
+}
+
+static SongMeta library_read_meta(AIL_Buffer *buf)
+{
+    SongMeta meta;
+    meta.hash          = ail_buf_read8lsb(buf);
+    meta.notes         = ail_buf_read4lsb(buf);
+    meta.cmds_size     = ail_buf_read4lsb(buf);
+    meta.max_polyphony = ail_buf_read2lsb(buf);
+    meta.min_key       = ail_buf_read1(buf);
+    meta.max_key       = ail_buf_read1(buf);
+    memcpy(meta.density, &buf->data[buf->idx], LIBRARY_DENSITY_BINS);
+    buf->idx += LIBRARY_DENSITY_BINS;
+    return meta;
+}
+
+// Computes the metadata of song from its commands
+// This takes O(KEYS_AMOUNT) per command and thus should be called while importing, not while drawing
+SongMeta library_song_meta(Song song)
+{
+    SongMeta meta = { .hash = 14695981039346656037ull, .notes = song.cmds.len, .cmds_size = song.cmds.len*sizeof(PidiCmd), .min_key = 0xFF };
+    u64 held_until[KEYS_AMOUNT] = { 0 };
+    u32 density[LIBRARY_DENSITY_BINS] = { 0 };
+    u64 time = 0;
+    for (u32 i = 0; i < song.cmds.len; i++) {
+        PidiCmd cmd = song.cmds.data[i];
+        u8 fields[] = { pidi_dt(cmd) & 0xFF, pidi_dt(cmd) >> 8, pidi_len(cmd), pidi_velocity(cmd), (u8)pidi_octave(cmd), pidi_key(cmd) };
+        for (u32 j = 0; j < sizeof(fields); j++) meta.hash = (meta.hash ^ fields[j])*1099511628211ull;
+
+        time += pidi_dt(cmd);
+        u8 idx = get_piano_idx(pidi_key(cmd), pidi_octave(cmd));
+        if (idx >= KEYS_AMOUNT) continue;
+        meta.min_key    = AIL_MIN(meta.min_key, idx);
+        meta.max_key    = AIL_MAX(meta.max_key, idx);
+        held_until[idx] = AIL_MAX(held_until[idx], time + pidi_len(cmd)*LEN_FACTOR);
+        u16 polyphony   = 0;
+        for (u32 k = 0; k < KEYS_AMOUNT; k++) polyphony += held_until[k] > time;
+        meta.max_polyphony = AIL_MAX(meta.max_polyphony, polyphony);
+        density[song.len ? AIL_MIN(time*LIBRARY_DENSITY_BINS/song.len, LIBRARY_DENSITY_BINS - 1) : 0]++;
+    }
+    if (meta.min_key > meta.max_key) meta.min_key = 0;
+    u32 max_density = 1;
+    for (u32 i = 0; i < LIBRARY_DENSITY_BINS; i++) max_density = AIL_MAX(max_density, density[i]);
+    for (u32 i = 0; i < LIBRARY_DENSITY_BINS; i++) meta.density[i] = density[i]*255/max_density;
+    return meta;
+}
+
+// Loads the snapshot and replays the journal on top of it
+// Missing or invalid files are treated as empty, and replaying stops at the first incomplete record (i.e. if the program crashed while writing it)
+AIL_DA(Song) library_load(LibraryFiles *files)
+{
+    AIL_DA(Song) library = ail_da_new_empty(Song);
+    files->journal_records = 0;
+    files->snapshot_songs  = 0;
+    bool torn = false;
+    FMap snapshot_map, journal_map;
+    bool has_snapshot = fmap_open(files->snapshot_path, &snapshot_map);
+    bool has_journal  = fmap_open(files->journal_path,  &journal_map);
+    // All names are reserved in a single chunk, before the first one is interned
+    // Names from the journal take up about twice as much space in the arena, as their records do in the file
+    u64 journal_names_size = has_journal ? 2*fmap_to_buf(journal_map).len : 0;
+
+    if (has_snapshot) {
+        AIL_Buffer buf = fmap_to_buf(snapshot_map);
+        if (buf.len >= 8 && ail_buf_read4msb(&buf) == PDIL_MAGIC) {
+            u32 n = ail_buf_read4lsb(&buf);
+            u32 version = 1;
+            if (n & LIBRARY_VERSION_FLAG) {
+                version = n & ~LIBRARY_VERSION_FLAG;
+                n       = buf.len - buf.idx >= 4 ? ail_buf_read4lsb(&buf) : 0;
+            }
+            u32 meta_size = version >= 2 ? LIBRARY_META_SIZE : 0;
+            // Every name takes up at most library_name_size(0) bytes plus twice its length in the arena
+            u64 entries_size = (u64)n*(12 + meta_size);
+            u64 names_len    = buf.len - buf.idx > entries_size ? buf.len - buf.idx - entries_size : 0;
+            n = AIL_MIN(n, (buf.len - buf.idx)/(12 + meta_size));
+            library_reserve_names((u64)n*library_name_size(0) + 2*names_len + journal_names_size);
+            journal_names_size = 0;
+            ail_da_maybe_grow(&library, n);
+            for (; n > 0 && buf.len - buf.idx >= 12 + meta_size; n--) {
+                u32 name_len  = ail_buf_read4lsb(&buf);
+                u64 song_len  = ail_buf_read8lsb(&buf);
+                SongMeta meta = meta_size ? library_read_meta(&buf) : (SongMeta){ 0 };
+                if (buf.len - buf.idx < name_len) break;
+                Song song = {
+                    .name = library_read_name(&buf, name_len, &meta),
+                    .len  = song_len,
+                    .cmds = ail_da_new_empty(PidiCmd),
+                };
+                ail_da_push(&library, song);
+            }
+        }
+        files->snapshot_songs = library.len;
+        fmap_close(&snapshot_map);
+    }
+
+    library_reserve_names(journal_names_size);
+    if (has_journal) {
+        AIL_Buffer buf = fmap_to_buf(journal_map);
+        if (buf.len >= 4 && ail_buf_read4msb(&buf) == LIBRARY_JOURNAL_MAGIC) {
+            // Each record adds at most one name, so the map never gets more than half full
+            LibraryNameMap names = { .cap = 16 };
+            while (names.cap < 2*(library.len + buf.len/LIBRARY_RECORD_HEADER_SIZE)) names.cap *= 2;
+            names.slots = calloc(names.cap, sizeof(u32));
+            for (u32 i = 0; i < library.len; i++) library_map_insert(&names, library.data[i].name, library_name_len(library.data[i].name), i);
+            bool deleted = false;
+            u64  end     = buf.idx; // End of the last complete record
+            while (buf.len - buf.idx >= LIBRARY_RECORD_HEADER_SIZE) {
+                u8  type        = ail_buf_read1(&buf);
+                u32 payload_len = ail_buf_read4lsb(&buf);
+                if (buf.len - buf.idx < payload_len) break;
+                end = buf.idx + payload_len;
+                AIL_Buffer rec = { .data = &buf.data[buf.idx], .idx = 0, .len = payload_len, .cap = payload_len };
+                buf.idx += payload_len;
+                files->journal_records++;
+                switch ((LibraryRecordType)type) {
+                    case LIBRARY_RECORD_ADD: {
+                        if (rec.len < 12) break;
+                        u32 name_len = ail_buf_read4lsb(&rec);
+                        u64 song_len = ail_buf_read8lsb(&rec);
+                        if (rec.len - rec.idx < name_len) break;
+                        AIL_Buffer meta_buf = { .data = &rec.data[rec.idx + name_len], .idx = 0, .len = rec.len - rec.idx - name_len };
+                        SongMeta meta       = meta_buf.len >= LIBRARY_META_SIZE ? library_read_meta(&meta_buf) : (SongMeta){ 0 };
+                        i32 idx = library_map_find(names, library, (char *)&rec.data[rec.idx], name_len);
+                        if (idx >= 0) {
+                            // The song was imported again, so its metadata might have changed as well
+                            library.data[idx].len  = song_len;
+                            library.data[idx].name = library_read_name(&rec, name_len, &meta);
+                            library_map_insert(&names, library.data[idx].name, name_len, idx);
+                        } else {
+                            Song song = {
+                                .name = library_read_name(&rec, name_len, &meta),
+                                .len  = song_len,
+                                .cmds = ail_da_new_empty(PidiCmd),
+                            };
+                            library_map_insert(&names, song.name, name_len, library.len);
+                            ail_da_push(&library, song);
+                        }
+                    } break;
+                    case LIBRARY_RECORD_RENAME: {
+                        if (rec.len < 4) break;
+                        u32 old_len = ail_buf_read4lsb(&rec);
+                        if (rec.len - rec.idx < (u64)old_len + 4) break;
+                        i32 idx  = library_map_find(names, library, (char *)&rec.data[rec.idx], old_len);
+                        rec.idx += old_len;
+                        u32 new_len = ail_buf_read4lsb(&rec);
+                        if (idx < 0 || rec.len - rec.idx < new_len) break;
+                        // Names are unique, so if the new name exists already, the record was already applied to the snapshot
+                        // (and the old name was taken by a song that was added later on)
+                        if (library_map_find(names, library, (char *)&rec.data[rec.idx], new_len) >= 0) break;
+                        library.data[idx].name = library_read_name(&rec, new_len, library_song_meta_of(library.data[idx].name));
+                        library_map_insert(&names, library.data[idx].name, new_len, idx);
+                    } break;
+                    case LIBRARY_RECORD_DELETE: {
+                        if (rec.len < 4) break;
+                        u32 name_len = ail_buf_read4lsb(&rec);
+                        if (rec.len - rec.idx < name_len) break;
+                        i32 idx = library_map_find(names, library, (char *)&rec.data[rec.idx], name_len);
+                        if (idx < 0) break;
+                        library.data[idx].name = NULL;
+                        deleted = true;
+                    } break;
+                    default:
+                        DBG_LOG("Skipping unknown record type %d in library journal\n", type);
+                }
+            }
+            free(names.slots);
+            torn = end < buf.len;
+            // Remove deleted songs, keeping the order of the remaining ones
+            if (deleted) {
+                u32 n = 0;
+                for (u32 i = 0; i < library.len; i++) {
+                    if (library.data[i].name) library.data[n++] = library.data[i];
+                }
+                library.len = n;
+            }
+        } else {
+            // Records appended to a journal without magic would never be replayed
+            torn = buf.len > 0;
+        }
+        fmap_close(&journal_map);
+    }
+    if (!library.cap) ail_da_maybe_grow(&library, 16);
+    if (torn) {
+        DBG_LOG("Removing torn record at the end of the library journal\n");
+        library_compact(library, files);
+    } else {
+        library_maybe_compact(library, files);
+    }
+    return library;
+}
+
+// Adds song with its metadata (see library_song_meta) to the library by appending a single record to the journal
+// The name of the song is interned, so it still belongs to the caller afterwards
+bool library_add(AIL_DA(Song) *library, Song song, const SongMeta *meta, LibraryFiles *files)
+{
+    u32 name_len       = strlen(song.name);
+    song.name          = library_intern(song.name, name_len, meta);
+    AIL_Buffer payload = ail_buf_new(12 + name_len + LIBRARY_META_SIZE);
+    ail_buf_write4lsb(&payload, name_len);
+    ail_buf_write8lsb(&payload, song.len);
+    ail_buf_writestr(&payload, song.name, name_len);
+    library_write_meta(&payload, library_song_meta_of(song.name));
+    ail_da_push(library, song);
+    bool succ = library_append_record(files, LIBRARY_RECORD_ADD, payload);
+    free(payload.data);
+    return succ && library_maybe_compact(*library, files);
+}
+
+// Renames the song at idx to new_name, which is interned and thus still belongs to the caller afterwards
+// @Note: The .pidi file of the song is not renamed
+bool library_rename(AIL_DA(Song) *library, u32 idx, char *new_name, LibraryFiles *files)
+{
+    AIL_ASSERT(idx < library->len);
+    char *old_name     = library->data[idx].name;
+    u32 old_len        = library_name_len(old_name);
+    u32 new_len        = strlen(new_name);
+    AIL_Buffer payload = ail_buf_new(8 + old_len + new_len);
+    ail_buf_write4lsb(&payload, old_len);
+    ail_buf_writestr(&payload, old_name, old_len);
+    ail_buf_write4lsb(&payload, new_len);
+    ail_buf_writestr(&payload, new_name, new_len);
+    library->data[idx].name = library_intern(new_name, new_len, library_song_meta_of(old_name));
+    bool succ = library_append_record(files, LIBRARY_RECORD_RENAME, payload);
+    free(payload.data);
+    return succ && library_maybe_compact(*library, files);
+}
+
+// Removes the song at idx from the library, keeping the order of the remaining songs
+// @Note: The .pidi file of the song is not deleted and the name stays in the arena
+bool library_delete(AIL_DA(Song) *library, u32 idx, LibraryFiles *files)
+{
+    AIL_ASSERT(idx < library->len);
+    char *name         = library->data[idx].name;
+    u32 name_len       = library_name_len(name);
+    AIL_Buffer payload = ail_buf_new(4 + name_len);
+    ail_buf_write4lsb(&payload, name_len);
+    ail_buf_writestr(&payload, name, name_len);
+    memmove(&library->data[idx], &library->data[idx + 1], (library->len - idx - 1)*sizeof(Song));
+    library->len--;
+    bool succ = library_append_record(files, LIBRARY_RECORD_DELETE, payload);
+    free(payload.data);
+    return succ && library_maybe_compact(*library, files);
+}
+
+// Writes the whole library into a new snapshot and clears the journal
+// The snapshot is written to a temporary file first, so that the old snapshot stays intact if writing fails
+bool library_compact(AIL_DA(Song) library, LibraryFiles *files)
+{
+    AIL_Buffer buf = ail_buf_new(1024);
+    ail_buf_write4msb(&buf, PDIL_MAGIC);
+    ail_buf_write4lsb(&buf, LIBRARY_VERSION_FLAG | LIBRARY_VERSION);
+    ail_buf_write4lsb(&buf, library.len);
+    for (u32 i = 0; i < library.len; i++) {
+        Song song    = library.data[i];
+        u32 name_len = library_name_len(song.name);
+        ail_buf_write4lsb(&buf, name_len);
+        ail_buf_write8lsb(&buf, song.len);
+        library_write_meta(&buf, library_song_meta_of(song.name));
+        ail_buf_writestr(&buf, song.name, name_len);
+    }
+    u64 path_len   = strlen(files->snapshot_path);
+    char *tmp_path = malloc(path_len + 5);
+    memcpy(tmp_path, files->snapshot_path, path_len);
+    memcpy(&tmp_path[path_len], ".tmp", 5);
+    bool succ = ail_buf_to_file(&buf, tmp_path);
+    free(buf.data);
+#ifdef _WIN32
+    succ = succ && MoveFileExA(tmp_path, files->snapshot_path, MOVEFILE_REPLACE_EXISTING);
+#else
+    succ = succ && !rename(tmp_path, files->snapshot_path);
+#endif
+    free(tmp_path);
+    if (!succ) return false;
+
+    AIL_Buffer header = ail_buf_new(4);
+    ail_buf_write4msb(&header, LIBRARY_JOURNAL_MAGIC);
+    succ = ail_buf_to_file(&header, files->journal_path);
+    free(header.data);
+    if (succ) files->journal_records = 0;
+    files->snapshot_songs = library.len; // The new snapshot was written, even if the journal couldn't be cleared
+    return succ;
+}
+
+static bool library_append_record(LibraryFiles *files, LibraryRecordType type, AIL_Buffer payload)
+{
+    FILE *f = fopen(files->journal_path, "ab");
+    if (!f) return false;
+    u8 header[4 + LIBRARY_RECORD_HEADER_SIZE];
+    u32 header_len = 0;
+    // A new journal starts with the magic
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0) {
+        header[header_len++] = (LIBRARY_JOURNAL_MAGIC >> 24) & 0xFF;
+        header[header_len++] = (LIBRARY_JOURNAL_MAGIC >> 16) & 0xFF;
+        header[header_len++] = (LIBRARY_JOURNAL_MAGIC >>  8) & 0xFF;
+        header[header_len++] = (LIBRARY_JOURNAL_MAGIC >>  0) & 0xFF;
+    }
+    header[header_len++] = type;
+    for (u32 i = 0; i < 4; i++) header[header_len++] = (payload.len >> (8*i)) & 0xFF;
+    bool succ = fwrite(header, 1, header_len, f) == header_len && fwrite(payload.data, 1, payload.len, f) == payload.len;
+    succ = !fclose(f) && succ;
+    files->journal_records += succ;
+    return succ;
+}
+
+// The records are compared against the songs of the last snapshot instead of the current library,
+// since a journal of only additions never has more records than the library has songs
+static bool library_maybe_compact(AIL_DA(Song) library, LibraryFiles *files)
+{
+    if (files->journal_records < LIBRARY_COMPACT_MIN_RECORDS || files->journal_records <= files->snapshot_songs) return true;
+    return library_compact(library, files);
+}
+
+#endif // LIBRARY_C_
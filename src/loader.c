@@ -0,0 +1,332 @@
+// Loading of songs in a background thread, so that reading files never blocks the UI
+//
+// The UI requests songs with loader_load and receives them through a completion queue, that it polls each frame with loader_poll
+// Songs can additionally be prefetched (i.e. the song under the mouse cursor), so that loading them after a click doesn't wait on the disk
+// Loaded songs are kept in a cache, until they haven't been used for the longest time and the cache exceeds its byte budget
+// The lists of a song returned by the loader are references into the cache, which are released by freeing them as usual
+// @Note: Only the loader thread reads files and only the UI thread requests and polls songs
+#ifndef LOADER_C_
+#define LOADER_C_
+
+#include "ail.h"
+#include "common.h"
+#include "pidi.c"
+#include <pthread.h>
+
+#define LOADER_QUEUE_LEN 16
+#define LOADER_PAGE_SIZE 4096
+#ifndef LOADER_CACHE_BUDGET
+#define LOADER_CACHE_BUDGET (64*1024*1024) // Default for the amount of bytes, that unused songs in the cache may take up
+#endif
+
+typedef struct LoadedSong {
+    Song      song;
+    PidiIndex index;
+    bool      succ;
+} LoadedSong;
+
+typedef struct LoaderCacheEntry {
+    AIL_Allocator ref_allocator; // Allocator of the commands handed out by the cache - freeing them releases the reference
+    LoadedSong    loaded;        // Owns the commands and index
+    u64           bytes;
+    u64           last_used;
+    u32           refs;
+} LoaderCacheEntry;
+typedef LoaderCacheEntry *LoaderCacheEntryPtr;
+AIL_DA_INIT(LoaderCacheEntryPtr);
+
+typedef struct LoaderCacheStats {
+    u32 hits;
+    u32 misses;
+    u32 songs;
+    u64 bytes;
+    u64 budget;
+} LoaderCacheStats;
+
+typedef struct LoaderQueue {
+    LoadedSong data[LOADER_QUEUE_LEN];
+    u8 start;
+    u8 end;
+} LoaderQueue;
+
+static const AIL_Str *loader_dir_path = NULL;
+static Song        loader_load_req     = { 0 }; // Song to load next (name is NULL if there is none)
+static Song        loader_prefetch_req = { 0 }; // Song to prefetch next (name is NULL if there is none)
+static LoaderQueue loader_done         = { 0 };
+
+// The cache is accessed by the loader thread and by whichever thread frees a song (usually the communication thread)
+static AIL_DA(LoaderCacheEntryPtr) loader_cache = { 0 };
+static u64 loader_cache_budget = LOADER_CACHE_BUDGET;
+static u64 loader_cache_bytes  = 0;
+static u64 loader_cache_tick   = 0; // Incremented whenever a song is used, to find the least recently used song
+static u32 loader_cache_hits   = 0;
+static u32 loader_cache_misses = 0;
+
+static pthread_mutex_t loader_mutex       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t loader_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  loader_cond        = PTHREAD_COND_INITIALIZER;
+
+// For communicating with the loader thread, the UI thread should call the following functions
+void *loader_thread_main(void *_data_dir_path);
+void loader_load(Song song);
+void loader_prefetch(Song song);
+bool loader_poll(LoadedSong *loaded);
+void loader_free(LoadedSong *loaded);
+void loader_set_cache_budget(u64 budget);
+LoaderCacheStats loader_cache_stats(void);
+
+// Internal only functions
+static LoaderCacheEntry *loader_cache_get(Song song, bool acquire);
+static void loader_cache_evict(void);
+static LoadedSong loader_read_song(Song song);
+static void loader_touch_pages(const void *data, u64 size);
+
+// Main loop of the loader thread
+// _data_dir_path points to the directory, that all .pidi files are stored in
+void *loader_thread_main(void *_data_dir_path)
+{
+    loader_dir_path = _data_dir_path;
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    loader_cache = ail_da_new(LoaderCacheEntryPtr);
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+    while (true) {
+        while (pthread_mutex_lock(&loader_mutex) != 0) {}
+        while (!loader_load_req.name && !loader_prefetch_req.name) pthread_cond_wait(&loader_cond, &loader_mutex);
+        // Songs requested for loading are prioritized over prefetching
+        bool is_load = loader_load_req.name != NULL;
+        Song song    = is_load ? loader_load_req : loader_prefetch_req;
+        if (is_load) loader_load_req.name     = NULL;
+        else         loader_prefetch_req.name = NULL;
+        while (pthread_mutex_unlock(&loader_mutex) != 0) {}
+
+        LoaderCacheEntry *entry = loader_cache_get(song, is_load);
+        if (is_load) {
+            LoadedSong loaded = { .song = song, .succ = false };
+            if (entry) {
+                // The returned lists point into the cached ones, but only freeing the commands does something (releasing the reference)
+                loaded = entry->loaded;
+                loaded.song.cmds.allocator = &entry->ref_allocator;
+                loaded.index.blocks.allocator = &pidi_view_allocator;
+                loaded.index.keys.allocator   = &pidi_view_allocator;
+                loaded.index.held             = (AIL_DA(PidiHeldKey)){ 0 };
+            }
+            while (pthread_mutex_lock(&loader_mutex) != 0) {}
+            u8 next_end = (loader_done.end + 1)%LOADER_QUEUE_LEN;
+            bool full   = next_end == loader_done.start;
+            if (!full) {
+                loader_done.data[loader_done.end] = loaded;
+                loader_done.end = next_end;
+            }
+            while (pthread_mutex_unlock(&loader_mutex) != 0) {}
+            if (full) {
+                DBG_LOG("Dropping loaded song '%s', since the UI didn't poll the loader\n", song.name);
+                loader_free(&loaded);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Requests song to be loaded - the result is returned by loader_poll
+// A request, that the loader didn't start working on yet, is replaced
+void loader_load(Song song)
+{
+    while (pthread_mutex_lock(&loader_mutex) != 0) {}
+    loader_load_req = song;
+    pthread_cond_signal(&loader_cond);
+    while (pthread_mutex_unlock(&loader_mutex) != 0) {}
+}
+
+// Requests song to be loaded into the cache ahead of time, without returning it
+void loader_prefetch(Song song)
+{
+    while (pthread_mutex_lock(&loader_mutex) != 0) {}
+    loader_prefetch_req = song;
+    pthread_cond_signal(&loader_cond);
+    while (pthread_mutex_unlock(&loader_mutex) != 0) {}
+}
+
+// Returns true and writes the next loaded song to loaded, if one is ready
+// The caller then holds a reference to the song in the cache (i.e. to hand it to send_new_song), which is released by freeing it with loader_free
+bool loader_poll(LoadedSong *loaded)
+{
+    while (pthread_mutex_lock(&loader_mutex) != 0) {}
+    bool ready = loader_done.start != loader_done.end;
+    if (ready) {
+        *loaded = loader_done.data[loader_done.start];
+        loader_done.start = (loader_done.start + 1)%LOADER_QUEUE_LEN;
+    }
+    while (pthread_mutex_unlock(&loader_mutex) != 0) {}
+    return ready;
+}
+
+void loader_free(LoadedSong *loaded)
+{
+    if (loaded->succ) {
+        // The index might point into the same mapping as the commands, so it is freed first
+        pidi_index_free(&loaded->index);
+        ail_da_free(&loaded->song.cmds);
+    }
+    *loaded = (LoadedSong){0};
+}
+
+// The cache may exceed the budget, while the songs in it are being used
+void loader_set_cache_budget(u64 budget)
+{
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    loader_cache_budget = budget;
+    loader_cache_evict();
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+}
+
+LoaderCacheStats loader_cache_stats(void)
+{
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    LoaderCacheStats stats = {
+        .hits   = loader_cache_hits,
+        .misses = loader_cache_misses,
+        .songs  = loader_cache.len,
+        .bytes  = loader_cache_bytes,
+        .budget = loader_cache_budget,
+    };
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+    return stats;
+}
+
+static void *loader_ref_alloc(void *data, u64 size)
+{
+    AIL_UNUSED(data);
+    AIL_UNUSED(size);
+    AIL_UNREACHABLE();
+    return NULL;
+}
+
+static void *loader_ref_zero_alloc(void *data, u64 nelem, u64 size_el)
+{
+    AIL_UNUSED(nelem);
+    return loader_ref_alloc(data, size_el);
+}
+
+static void *loader_ref_re_alloc(void *data, void *ptr, u64 size)
+{
+    AIL_UNUSED(ptr);
+    return loader_ref_alloc(data, size);
+}
+
+// Releases a reference to the cache entry
+static void loader_ref_free_one(void *data, void *ptr)
+{
+    AIL_UNUSED(ptr);
+    LoaderCacheEntry *entry = data;
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    AIL_ASSERT(entry->refs > 0);
+    entry->refs--;
+    loader_cache_evict();
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+}
+
+static void loader_ref_free_all(void *data)
+{
+    loader_ref_free_one(data, NULL);
+}
+
+// Returns the cache entry of song, reading the song from disk if it isn't cached yet
+// If acquire is true, the entry is referenced and counted as hit or miss of the cache
+// Returns NULL if the song couldn't be read
+static LoaderCacheEntry *loader_cache_get(Song song, bool acquire)
+{
+    LoaderCacheEntry *entry = NULL;
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    for (u32 i = 0; i < loader_cache.len && !entry; i++) {
+        if (!strcmp(loader_cache.data[i]->loaded.song.name, song.name)) entry = loader_cache.data[i];
+    }
+    if (entry) {
+        entry->last_used = ++loader_cache_tick;
+        entry->refs     += acquire;
+    }
+    if (acquire) {
+        loader_cache_hits   += entry != NULL;
+        loader_cache_misses += entry == NULL;
+    }
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+    if (entry) return entry;
+
+    // The cache isn't locked while reading, so that releasing songs doesn't wait on the disk
+    LoadedSong loaded = loader_read_song(song);
+    if (!loaded.succ) return NULL;
+    entry  = malloc(sizeof(LoaderCacheEntry));
+    *entry = (LoaderCacheEntry) {
+        .ref_allocator = {
+            .data       = entry,
+            .alloc      = loader_ref_alloc,
+            .zero_alloc = loader_ref_zero_alloc,
+            .re_alloc   = loader_ref_re_alloc,
+            .free_one   = loader_ref_free_one,
+            .free_all   = loader_ref_free_all,
+        },
+        .loaded = loaded,
+        .bytes  = (u64)loaded.song.cmds.len*sizeof(PidiCmd) + (u64)loaded.index.blocks.len*sizeof(PidiBlock) + (u64)loaded.index.keys.len*sizeof(PidiHeldKey),
+        .refs   = acquire,
+    };
+    while (pthread_mutex_lock(&loader_cache_mutex) != 0) {}
+    entry->last_used    = ++loader_cache_tick;
+    loader_cache_bytes += entry->bytes;
+    ail_da_push(&loader_cache, entry);
+    loader_cache_evict();
+    while (pthread_mutex_unlock(&loader_cache_mutex) != 0) {}
+    // A prefetched song might have been evicted right away, if it is larger than the budget
+    return acquire ? entry : NULL;
+}
+
+// Removes the least recently used songs, that aren't referenced, until the cache fits into its budget
+// The cache needs to be locked already
+static void loader_cache_evict(void)
+{
+    while (loader_cache_bytes > loader_cache_budget) {
+        i32 lru = -1;
+        for (u32 i = 0; i < loader_cache.len; i++) {
+            LoaderCacheEntry *entry = loader_cache.data[i];
+            if (!entry->refs && (lru < 0 || entry->last_used < loader_cache.data[lru]->last_used)) lru = i;
+        }
+        if (lru < 0) break;
+        LoaderCacheEntry *entry = loader_cache.data[lru];
+        loader_cache.data[lru]  = loader_cache.data[--loader_cache.len];
+        loader_cache_bytes     -= entry->bytes;
+        loader_free(&entry->loaded);
+        free(entry);
+    }
+}
+
+// Loads the PIDI-file (as referred to by song.name)
+static LoadedSong loader_read_song(Song song)
+{
+    u64 data_dir_path_len = loader_dir_path->len;
+    u64 name_len          = strlen(song.name);
+    char *fname = malloc(data_dir_path_len + name_len + 6);
+    memcpy(fname, loader_dir_path->str, data_dir_path_len);
+    memcpy(&fname[data_dir_path_len], song.name, name_len);
+    memcpy(&fname[data_dir_path_len + name_len], ".pidi", 6);
+    LoadedSong loaded = { .song = song };
+    loaded.succ = pidi_load(fname, &loaded.song.cmds, &loaded.index);
+    if (!loaded.succ) DBG_LOG("Failed to load '%s'\n", fname);
+    free(fname);
+    if (loaded.succ) {
+        // Mapped files are only read from disk once they are accessed, which should happen here instead of in the UI or communication thread
+        loader_touch_pages(loaded.song.cmds.data, (u64)loaded.song.cmds.len*sizeof(PidiCmd));
+        loader_touch_pages(loaded.index.blocks.data, (u64)loaded.index.blocks.len*sizeof(PidiBlock));
+        loader_touch_pages(loaded.index.keys.data, (u64)loaded.index.keys.len*sizeof(PidiHeldKey));
+    }
+    return loaded;
+}
+
+// Reads one byte of each page in data, so that all of it is paged in
+static void loader_touch_pages(const void *data, u64 size)
+{
+    const volatile u8 *bytes = data;
+    u8 sum = 0;
+    for (u64 i = 0; i < size; i += LOADER_PAGE_SIZE) sum += bytes[i];
+    if (size) sum += bytes[size - 1];
+    AIL_UNUSED(sum);
+}
+
+#endif // LOADER_C_
@@ -33,7 +33,11 @@ static RL_MouseCursor cursor;
 #include <unistd.h>  // For sleep @Cleanup
 #include "math.h"    // For sinf, cosf
 #include "midi.c"
+#include "pidi.c"
 #include "comm.c"
+#include "loader.c"
+#include "library.c"
+#include "search.c"
 // #define AIL_ALLOC_PRINT_MEM
 #include "ail_alloc.h"
 #include "ail.h"
@@ -59,10 +63,13 @@ static RL_MouseCursor cursor;
 #define ON_SURFACE_COLOR       (RL_Color) { 0xff, 0xff, 0xff, 0xff }
 #define ON_ERROR_COLOR         (RL_Color) { 0xff, 0x00, 0x00, 0xff }
 
-const AIL_Str data_dir_path    = { .str = "./data/", .len = 7 };
-const AIL_Str library_filepath = { .str = "./data/library.pdil", .len = 19 };
+const AIL_Str data_dir_path            = { .str = "./data/", .len = 7 };
+const AIL_Str library_filepath         = { .str = "./data/library.pdil", .len = 19 };
+const AIL_Str library_journal_filepath = { .str = "./data/library.pdij", .len = 19 };
 
 #define FPS 60
+#define PREFETCH_HOVER_FRAMES (FPS/5) // Amount of frames a song needs to be hovered, before it is prefetched
+#define SEARCH_DEBOUNCE_FRAMES (FPS/20) // Amount of frames the search text needs to stay unchanged, before it is searched for
 
 typedef enum {
     UI_VIEW_LIBRARY,      // Show the library (possibly with search results)
@@ -73,12 +80,10 @@ typedef enum {
 
 static inline bool draw_icon(RL_Texture icon, u8 texture_idx, f32 x, f32 y, f32 icon_size, bool *pressed);
 RL_Texture get_texture(const char *filepath);
-AIL_DA(Song) search_songs(const char *substr);
 void draw_loading_anim(u32 win_width, u32 win_height, bool start_new);
+void draw_song_preview(const SongMeta *meta, RL_Rectangle bounds, RL_Rectangle clip);
 bool is_songname_taken(const char *name);
-void  load_pidi(Song *song);
 bool  save_pidi(Song song);
-bool  save_library();
 void *load_library(void *arg);
 void *parse_file(void *_filepath);
 void *util_memadd(const void *a, u64 a_size, const void *b, u64 b_size);
@@ -88,13 +93,19 @@ void *util_memadd(const void *a, u64 a_size, const void *b, u64 b_size);
 char *filename;
 char *song_name;
 Song song;
+static SongMeta song_meta;
 static bool file_parsed;
+static bool file_streamed; // Whether the song was already sent to the piano while being parsed
 static char *err_msg;
 
 // These variables are all accessed by main and load_library
-// @TODO: Make library into a Trie to simplify search
 AIL_DA(Song) library = { .allocator = &ail_default_allocator };
 bool library_ready = false;
+static LibraryFiles library_files;
+static SearchTrie   library_trie;
+static SearchTrigrams library_trigrams;
+static bool           library_trigrams_ready = false; // The trigram index is built after the library is ready
+static SearchSources  search_sources = { &library, &library_trie, &library_trigrams, &library_trigrams_ready };
 
 
 UI_View view = UI_VIEW_LIBRARY;
@@ -121,9 +132,13 @@ int main(void)
     pthread_t fileParsingThread;
     pthread_t loadLibraryThread;
     pthread_t commThread;
+    pthread_t loaderThread;
+    pthread_t searchThread;
 
     pthread_create(&loadLibraryThread, NULL, load_library, NULL);
     pthread_create(&commThread, NULL, comm_thread_main, NULL);
+    pthread_create(&loaderThread, NULL, loader_thread_main, (void *)&data_dir_path);
+    pthread_create(&searchThread, NULL, search_thread_main, (void *)&search_sources);
 
     // Load Icons
 #define ICON_TEXTURE_SIZE 512
@@ -327,6 +342,20 @@ int main(void)
 
         if (requires_recalc) centered_label.bounds = (RL_Rectangle){0, 0, win_width, win_height};
 
+        // Start playing songs, once the loader read them
+        LoadedSong loaded;
+        while (loader_poll(&loaded)) {
+            if (loaded.succ && comm_is_connected) {
+                printf("\033[33mSending song with %d commands\033[0m\n", loaded.song.cmds.len);
+                send_new_song(loaded.song.cmds, loaded.index, 0);
+                is_music_playing = true;
+                cur_music_len    = loaded.song.len;
+                cur_music_time   = 0;
+            } else {
+                loader_free(&loaded);
+            }
+        }
+
         switch(view) {
             // @TODO: Display song timeline at the bottom (allowing user to jump back and forth on it)
             case UI_VIEW_LIBRARY: {
@@ -385,10 +414,25 @@ int main(void)
                     search_text = search_input_box.label.text.data;
 
                     static AIL_DA(Song) songs;
-                    if (search_res.updated && search_input_box.label.text.len) {
-                        if (songs.data != library.data) ail_da_free(&songs);
-                        songs = search_songs(search_input_box.label.text.data);
-                    } else if (!songs.data || library_updated) songs = library;
+                    static AIL_DA(Song) search_results;
+                    static u32 search_debounce = 0;
+                    static u32 search_cleared  = 0; // Generation of the request, that cancelled the search when the search box was cleared
+                    bool has_query = search_input_box.label.text.len > 0;
+                    if (search_res.updated || library_updated) {
+                        // Searching happens in the search thread and only starts once the search text stopped changing for a few frames
+                        search_debounce = SEARCH_DEBOUNCE_FRAMES;
+                        if (!has_query) {
+                            search_cleared = search_request(""); // Cancels the previous search
+                            songs = library;
+                        }
+                    }
+                    if (search_debounce && !--search_debounce && has_query) search_request(search_text);
+                    // The (empty) results of the request from clearing the search box, or of any request before it, are ignored,
+                    // so the grid keeps showing the library until the results of the new query arrive
+                    // @Note: songs is set to library when clearing the search box, so ignored results never overwrite the shown songs
+                    u32 polled_gen = search_poll(library, &search_results);
+                    if (polled_gen > search_cleared && has_query) songs = search_results;
+                    else if (!songs.data) songs = library;
 
 
                     // @Cleanup: Magic numbers hidden deep inside function
@@ -406,6 +450,11 @@ int main(void)
                     scroll = AIL_MIN(scroll, max_y);
                     u32 start_row             = scroll / (full_song_name_height + song_name_margin);
 
+                    static char *hovered_song_name = NULL;
+                    static u32   hovered_frames    = 0;
+                    RL_Vector2   mouse_pos         = GetMousePosition();
+                    bool         mouse_in_content  = ail_gui_isPointInRec(mouse_pos.x, mouse_pos.y, content_bounds.x, content_bounds.y, content_bounds.width, content_bounds.height);
+                    i32          hovered_idx       = -1;
                     for (u32 i = start_row * song_names_per_row; i < songs.len; i++) {
                         RL_Rectangle song_bounds = {
                             start_x + (full_song_name_width + song_name_margin)*(i % song_names_per_row) + 2*style_song_name_default.border_width,
@@ -415,25 +464,29 @@ int main(void)
                         };
                         char *song_name = songs.data[i].name;
                         AIL_Gui_Label song_label = {
-                            .text         = ail_da_from_parts(char, song_name, strlen(song_name), strlen(song_name), &ail_default_allocator),
+                            .text         = ail_da_from_parts(char, song_name, library_name_len(song_name), library_name_len(song_name), &ail_default_allocator),
                             .bounds       = song_bounds,
                             .defaultStyle = style_song_name_default,
                             .hovered      = style_song_name_hover,
                         };
                         AIL_Gui_State song_label_state = ail_gui_drawLabelOuterBounds(song_label, content_bounds);
+                        draw_song_preview(library_song_meta_of(song_name), song_bounds, content_bounds);
+                        if (mouse_in_content && ail_gui_isPointInRec(mouse_pos.x, mouse_pos.y, song_bounds.x, song_bounds.y, song_bounds.width, song_bounds.height)) hovered_idx = i;
                         if (song_label_state == AIL_GUI_STATE_PRESSED && comm_is_connected) {
                             DBG_LOG("Playing song: %s\n", song_name);
                             // @TODO: Display hover style of songs differently if not connected maybe?
-                            // @TODO: Reading file blocks UI thread...
-                            Song s = songs.data[i];
-                            load_pidi(&s);
-                            printf("\033[33mSending song with %d commands\033[0m\n", s.cmds.len);
-                            send_new_song(s.cmds, 0);
-                            is_music_playing = true;
-                            cur_music_len    = s.len;
-                            cur_music_time   = 0;
+                            // The song starts playing once the loader is done with it
+                            loader_load(songs.data[i]);
                         }
                     }
+                    // Prefetch the song under the cursor, so that it is ready when it gets clicked
+                    char *hovered_name = hovered_idx < 0 ? NULL : songs.data[hovered_idx].name;
+                    if (hovered_name != hovered_song_name) {
+                        hovered_song_name = hovered_name;
+                        hovered_frames    = 0;
+                    } else if (hovered_name && ++hovered_frames == PREFETCH_HOVER_FRAMES) {
+                        loader_prefetch(songs.data[hovered_idx]);
+                    }
                 }
 
 
@@ -546,7 +599,7 @@ int main(void)
 timeline_jump:
                             played_perc    = ((f32)(mouse.x - total_rect.x))/(f32)total_rect.width;
                             cur_music_time = AIL_LERP(played_perc, 0, cur_music_len);
-                            send_new_song(comm_cmds, (u32)cur_music_time);
+                            seek_song((u32)cur_music_time);
                             timeline_selected = false;
                         }
                     }
@@ -663,17 +716,34 @@ timeline_jump:
             case UI_VIEW_PARSING_SONG: {
                 draw_loading_anim(win_width, win_height, view_changed);
                 if (file_parsed) {
+                    if (file_streamed) {
+                        is_music_playing = true;
+                        cur_music_len    = song.len;
+                        cur_music_time   = 0;
+                    }
                     song.name = song_name;
-                    ail_da_push(&library, song);
                     library_updated = 2; // setting it to 2 instead of true, because we reduce it by 1 each frame (up to 0) and thus it will still be greater 0 when being checked next frame
                     if (!save_pidi(song)) AIL_TODO();
-                    if (!save_library()) AIL_TODO();
+                    search_library_lock();
+                    if (!library_add(&library, song, &song_meta, &library_files)) AIL_TODO();
+                    search_trie_insert(&library_trie, library.data[library.len - 1].name, library.len - 1);
+                    search_library_changed();
+                    search_library_unlock();
                     SET_VIEW(UI_VIEW_LIBRARY);
                 }
             } break;
         }
 
         RL_DrawFPS(10, 10); // @Cleanup
+#ifdef UI_DEBUG
+        {
+            LoaderCacheStats cache_stats = loader_cache_stats();
+            char cache_text[128];
+            snprintf(cache_text, sizeof(cache_text), "Cache: %u hits, %u misses, %u songs, %llu/%llu KB",
+                     cache_stats.hits, cache_stats.misses, cache_stats.songs, (unsigned long long)cache_stats.bytes/1024, (unsigned long long)cache_stats.budget/1024);
+            RL_DrawText(cache_text, 10, 30, 20, RL_LIME);
+        }
+#endif
 
         SetMouseCursor(cursor);
         RL_EndDrawing();
@@ -685,6 +755,20 @@ timeline_jump:
     return 0;
 }
 
+// Draws the note density of a song as bars along the bottom of its card, clipped to clip
+void draw_song_preview(const SongMeta *meta, RL_Rectangle bounds, RL_Rectangle clip)
+{
+    if (!meta->notes) return; // Songs imported before metadata existed have no preview
+    f32 bar_width  = bounds.width / LIBRARY_DENSITY_BINS;
+    f32 max_height = bounds.height / 4;
+    for (u32 i = 0; i < LIBRARY_DENSITY_BINS; i++) {
+        f32 height = max_height*meta->density[i]/255.0f;
+        RL_Rectangle bar = { bounds.x + i*bar_width, bounds.y + bounds.height - height, bar_width - 1, height };
+        RL_Rectangle visible = GetCollisionRec(bar, clip);
+        if (visible.width > 0 && visible.height > 0) DrawRectangleRec(visible, ColorAlpha(RL_RED, 0.6f));
+    }
+}
+
 void draw_loading_anim(u32 win_width, u32 win_height, bool start_new)
 {
     static       u32 loading_anim_idx             = 0;
@@ -757,87 +841,16 @@ void* util_memadd(const void *a, u64 a_size, const void *b, u64 b_size)
 
 bool is_songname_taken(const char *name)
 {
+    u32 name_len = strlen(name);
     for (u32 i = 0; i < library.len; i++) {
-        if (strcmp(name, library.data[i].name) == 0) return true;
+        if (library_name_len(library.data[i].name) == name_len && memcmp(name, library.data[i].name, name_len) == 0) return true;
     }
     return false;
 }
 
-bool is_prefix(const char *restrict prefix, const char *restrict str, bool ignore_case)
-{
-    bool is_prefix = true;
-    u32 i = 0;
-    for (; str[i] && prefix[i] && is_prefix; i++) {
-        char c1 = str[i];
-        char c2 = prefix[i];
-        if (ignore_case && str[i]    >= 'A' && str[i]    <= 'Z') c1 += 'a' - 'A';
-        if (ignore_case && prefix[i] >= 'A' && prefix[i] <= 'Z') c2 += 'a' - 'A';
-        is_prefix = c1 == c2;
-    }
-    return is_prefix && !prefix[i];
-}
-
-AIL_DA(Song) search_songs(const char *substr)
-{
-    AIL_DA(Song) prefixed    = ail_da_new(Song);
-    AIL_DA(Song) substringed = ail_da_new(Song);
-    u32 substr_len = strlen(substr);
-    DBG_LOG("substr: %s\n", substr);
-    DBG_LOG("library: { data: %p, len: %d, cap: %d }\n", (void *)library.data, library.len, library.cap);
-    for (u32 i = 0; i < library.len; i++) {
-        // Check for prefix
-        DBG_LOG("i: %d, s: %s\n", i, library.data[i].name);
-        if (is_prefix(substr, library.data[i].name, true)) {
-            DBG_LOG("is prefix\n");
-            ail_da_push(&prefixed, library.data[i]);
-        } else {
-            // Check for substring
-            bool is_substr = false;
-            u32 name_len = strlen(library.data[i].name);
-            if (name_len > substr_len) {
-                for (u32 j = 1; !is_substr && j <= name_len - substr_len; j++) {
-                    DBG_LOG("j: %d\n", j);
-                    is_substr = is_prefix(substr, &library.data[i].name[j], true);
-                }
-            }
-            if (is_substr) DBG_LOG("is substring\n");
-            if (is_substr) ail_da_push(&substringed, library.data[i]);
-        }
-    }
-    ail_da_pushn(&prefixed, substringed.data, substringed.len);
-    ail_da_free(&substringed);
-    return prefixed;
-}
-
-// loads the PIDI-file (as referred to by song->name) into song
-void load_pidi(Song *song)
-{
-    u64 data_dir_path_len = data_dir_path.len;
-    u64 name_len          = strlen(song->name);
-    char *fname = malloc(data_dir_path_len + name_len + 6);
-    memcpy(fname, data_dir_path.str, data_dir_path_len);
-    memcpy(&fname[data_dir_path_len], song->name, name_len);
-    memcpy(&fname[data_dir_path_len + name_len], ".pidi", 6);
-    AIL_Buffer buf = ail_buf_from_file(fname);
-    free(fname);
-    AIL_ASSERT(ail_buf_read4msb(&buf) == PIDI_MAGIC);
-    u32 n = ail_buf_read4lsb(&buf);
-    song->cmds.data = song->cmds.allocator->alloc(song->cmds.allocator->data, n * sizeof(PidiCmd));
-    song->cmds.cap  = n;
-    song->cmds.len  = n;
-    for (u32 i = 0; i < n; i++) {
-        song->cmds.data[i] = decode_cmd(&buf);
-    }
-}
-
 bool save_pidi(Song song)
 {
-    AIL_Buffer buf = ail_buf_new(1024);
-    ail_buf_write4msb(&buf, PIDI_MAGIC);
-    ail_buf_write4lsb(&buf, song.cmds.len);
-    for (u32 i = 0; i < song.cmds.len; i++) {
-        encode_cmd(&buf, song.cmds.data[i]);
-    }
+    AIL_Buffer buf = pidi_encode(song.cmds.data, song.cmds.len, PIDI_COMPRESS_DEFAULT);
 
     u64 data_dir_path_len = data_dir_path.len;
     u64 name_len          = strlen(song.name);
@@ -850,58 +863,38 @@ bool save_pidi(Song song)
     return out;
 }
 
-bool save_library()
-{
-    AIL_Buffer buf = ail_buf_new(1024);
-    ail_buf_write4msb(&buf, PDIL_MAGIC);
-    ail_buf_write4lsb(&buf, library.len);
-    for (u32 i = 0; i < library.len; i++) {
-        Song song = library.data[i];
-        u32 name_len  = strlen(song.name);
-        ail_buf_write4lsb(&buf, name_len);
-        ail_buf_write8lsb(&buf, song.len);
-        ail_buf_writestr(&buf, song.name, name_len);
-    }
-    if (!RL_DirectoryExists(data_dir_path.str)) mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    return ail_buf_to_file(&buf, library_filepath.str);
-}
-
 void *load_library(void *arg)
 {
     (void)arg;
     library_ready = false;
     ail_da_free(&library);
 
-    if (!RL_DirectoryExists(data_dir_path.str)) {
-        mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-        goto nothing_to_load;
-    } else {
-        if (!RL_FileExists(library_filepath.str)) goto nothing_to_load;
-        AIL_Buffer buf = ail_buf_from_file(library_filepath.str);
-        if (ail_buf_read4msb(&buf) != PDIL_MAGIC) goto nothing_to_load;
-        u32 n = ail_buf_read4lsb(&buf);
-        ail_da_maybe_grow(&library, n);
-        for (; n > 0; n--) {
-            u32 name_len = ail_buf_read4lsb(&buf);
-            u64 song_len = ail_buf_read8lsb(&buf);
-            char *name   = ail_buf_readstr(&buf, name_len);
-            Song song = {
-                .name   = name,
-                .len    = song_len,
-                .cmds = ail_da_new_empty(PidiCmd),
-            };
-            ail_da_push(&library, song);
-        }
-        goto end;
-    }
+    if (!RL_DirectoryExists(data_dir_path.str)) mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    library_files = (LibraryFiles) {
+        .snapshot_path = library_filepath.str,
+        .journal_path  = library_journal_filepath.str,
+    };
+    library      = library_load(&library_files);
+    library_trie = search_trie_build(library);
+    // The names are copied before the library is ready, since the UI may add songs to the library while the index is built
+    u32 n        = library.len;
+    char **names = malloc(n*sizeof(char *));
+    for (u32 i = 0; i < n; i++) names[i] = library.data[i].name;
 
-nothing_to_load:
-    ail_da_maybe_grow(&library, 16);
-end:
     library_ready = true;
+    // The index is only published while holding the library lock, so that the search thread never sees a partially written index
+    SearchTrigrams trigrams = search_trigrams_build(names, n);
+    search_library_lock();
+    library_trigrams       = trigrams;
+    library_trigrams_ready = true;
+    search_library_unlock();
+    free(names);
     return NULL;
 }
 
+// Parses the dropped MIDI file at _filepath into song
+// @Note: While the piano is connected, the file is decoded with a MidiStream, so that the piano starts playing before the whole file was parsed
+// A MidiStream decodes all tracks on this thread though, so otherwise the file is parsed with parse_midi, which parses its tracks in parallel
 void *parse_file(void *_filepath)
 {
     file_parsed    = false;
@@ -930,18 +923,71 @@ void *parse_file(void *_filepath)
     new_filename[name_len] = 0;
     filename = new_filename;
 
-    AIL_Buffer buffer = ail_buf_from_file(filepath);
+    // The file is mapped instead of read into memory, so that huge MIDI files don't need to be copied to the heap first
+    FMap fmap;
+    if (!fmap_open(filepath, &fmap)) {
+        err_msg     = "Failed to open the file\n";
+        file_parsed = true;
+        return NULL;
+    }
 
-    ParseMidiRes res = parse_midi(buffer);
-    err_msg = NULL;
-    if (res.succ) {
-        res.val.song.name = filename;
-        song = res.val.song;
+    static char err[256];
+    file_streamed = false;
+    err_msg       = NULL;
+    if (!comm_is_connected) {
+        ParseMidiRes res = parse_midi(fmap_to_buf(fmap), &ail_default_allocator);
+        fmap_close(&fmap);
+        if (res.succ) {
+            song      = res.val.song;
+            song.name = filename;
+            song_meta = library_song_meta(song);
+        } else {
+            DBG_LOG("error in parsing: %s\n", res.val.err);
+            memcpy(err, res.val.err, sizeof(err));
+            err_msg = err;
+        }
+        file_parsed = true;
+        return NULL;
     }
-    else {
-        DBG_LOG("error in parsing: %s\n", res.val.err);
-        err_msg = res.val.err;
+
+    // The song is decoded incrementally, so that the piano can start playing it before the whole file was parsed
+    MidiStream stream;
+    if (!midi_stream_open(&stream, fmap_to_buf(fmap), err)) {
+        DBG_LOG("error in parsing: %s\n", err);
+        err_msg = err;
+        fmap_close(&fmap);
+        file_parsed = true;
+        return NULL;
     }
+    AIL_DA(PidiCmd) cmds = ail_da_new(PidiCmd);
+    PidiCmd block[CMDS_LIST_LEN];
+    u32  n;
+    u32  streamed_song = 0;
+    bool can_stream    = true; // Once another song replaced the streamed one (i.e. because the user clicked a song), streaming stops
+    do {
+        n = midi_stream_next(&stream, block, CMDS_LIST_LEN);
+        if (!n) break;
+        if (file_streamed) {
+            if (!append_song_cmds(streamed_song, block, n)) {
+                file_streamed = false;
+                can_stream    = false;
+            }
+        } else if (can_stream && comm_is_connected) {
+            AIL_DA(PidiCmd) first_block = ail_da_new_with_cap(PidiCmd, n);
+            ail_da_pushn(&first_block, block, n);
+            streamed_song = send_new_song(first_block, pidi_index_new(), 0);
+            file_streamed = true;
+        }
+        ail_da_pushn(&cmds, block, n);
+    } while (n == CMDS_LIST_LEN);
+    song = (Song) {
+        .name = filename,
+        .cmds = cmds,
+        .len  = stream.song_len,
+    };
+    song_meta = library_song_meta(song);
+    midi_stream_close(&stream);
+    fmap_close(&fmap);
     file_parsed = true;
     return NULL;
 }
\ No newline at end of file
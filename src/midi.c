@@ -1,14 +1,20 @@
 #define AIL_ALL_IMPL
 #define AIL_FS_IMPL
 #define AIL_BUF_IMPL
+#define AIL_ALLOC_IMPL
 #include "common.h"
 #include <stdbool.h> // For boolean definitions
 #include <stdlib.h>  // For malloc, memcpy, free
+#include <pthread.h> // For parsing tracks in parallel
 #include "ail.h"
 #include "ail_fs.h"
 #include "ail_buf.h"
-
-// @TODO: Use custom allocators instead of malloc here
+#include "ail_alloc.h"
+#include "fmap.c"
+#if defined(__SSE2__) && !defined(MIDI_NO_SIMD)
+#define MIDI_USE_SSE2
+#include <emmintrin.h> // For _mm_loadu_si128, _mm_movemask_epi8
+#endif
 
 typedef AIL_DA(PidiCmd) PidiCmdList;
 AIL_DA_INIT(PidiCmdList);
@@ -18,9 +24,16 @@ typedef union {
 	char err[256];
 } ParseMidiResVal;
 
+// Memory used by parse_midi in bytes
+typedef struct {
+	u64 scratch; // Only needed while parsing and released before parse_midi returns
+	u64 song;    // Size of the resulting list of commands
+} MidiParseStats;
+
 typedef struct {
 	bool succ;
 	ParseMidiResVal val;
+	MidiParseStats stats;
 } ParseMidiRes;
 
 typedef struct PidiCmdTimed {
@@ -30,292 +43,815 @@ typedef struct PidiCmdTimed {
 AIL_DA_INIT(PidiCmdTimed);
 
 #define MIDI_MAX_VELOCITY 127
-#define MIDI_MIN_CMD_SIZE 3 // at least delta_time: 1, key: 1, velocity: 1
 #define MIDI_0KEY_OCTAVE -5
 #define MIDI_NOTE_TO_OCTAVE(note) ((MIDI_0KEY_OCTAVE + ((note) / PIANO_KEY_AMOUNT)))
 #define MIDI_NOTE_TO_KEY(note)    ((note) % PIANO_KEY_AMOUNT)
-#define MIDI_TICKS_TO_MS(ticks, tempo, ticksPQN) ((ticks) * (u32)(((f32)(tempo) / (f32)(ticksPQN)) / 1000.0f))
+#define MIDI_NOTES_AMOUNT 128
+#define MIDI_OPEN_NOTE_IDX(octave, key) (((octave) - MIDI_0KEY_OCTAVE)*PIANO_KEY_AMOUNT + (key))
+#define MIDI_DEFAULT_TEMPO 500000 // in µs per quarter-note. 500000µs = 120BPM
+#define MIDI_STREAM_COMPACT_MIN 1024 // Minimum amount of emitted cmds of a track, before they are removed from the track's list
+#define MIDI_WRITE_HEADER_MAX_SIZE 128 // Upper bound for the bytes written by write_timed_midi before the first and after the last note
+#define MIDI_WRITE_EVENT_MAX_SIZE  7   // delta_time: 4, status: 1, key: 1, velocity: 1
+#define MIDI_ARENA_ALIGN 16 // Space reserved for padding per allocation in the parser's scratch arena
+#ifndef MIDI_PARSE_THREADS_COUNT
+#define MIDI_PARSE_THREADS_COUNT 4 // Maximum amount of threads used for parsing the tracks of a single file
+#endif
+
+// A segment of the song in which the tempo stays the same
+typedef struct MidiTempoSegment {
+    u64 tick;  // Absolute tick at which the segment starts
+    u64 time;  // Start-Time of the segment in µs*ticksPQN (kept in this unit, so no rounding happens when summing up the segments)
+    u32 tempo; // in µs per quarter-note
+} MidiTempoSegment;
+AIL_DA_INIT(MidiTempoSegment);
+
+// @Note: The tempo map is shared by all tracks, as Set Tempo events are only allowed in the first track (format 1) or the only track (format 0)
+// For format 2 files, the tempo events of all tracks are combined as well
+typedef struct MidiTempoMap {
+    AIL_DA(MidiTempoSegment) segs; // Sorted by tick, the first segment always starts at tick 0
+    u16 ticksPQN;
+} MidiTempoMap;
+
+// Position of a track's events in the file
+typedef struct MidiTrackChunk {
+    u64 offset; // Index of the first event (right after the chunk's header)
+    u32 len;
+    u32 notes;  // Amount of note-on events, which is exactly the amount of cmds parsed from the chunk
+} MidiTrackChunk;
+AIL_DA_INIT(MidiTrackChunk);
+
+// A note-on event, for which no matching note-off event was found yet
+typedef struct MidiOpenNote {
+    u32  idx;      // Index of the note's cmd in the track's cmd list
+    u64  start_ms; // Absolute start-time of the note in ms
+    bool open;
+} MidiOpenNote;
+
+// State of a single track, that is being decoded event by event
+typedef struct MidiTrackCursor {
+    AIL_Buffer          buffer;     // buffer.idx is the index of the next event
+    u64                 chunk_end;
+    const MidiTempoMap *tempo_map;
+    u64                 tick;       // Absolute tick of the last decoded event
+    u64                 last_on_ms; // Absolute time of the last note-on event in ms
+    u8                  command;    // used in running status (@Note: status == command)
+    u8                  channel;    // used in running status
+    bool                done;
+    MidiOpenNote        open_notes[MIDI_NOTES_AMOUNT]; // Indexed by MIDI_OPEN_NOTE_IDX(octave, key)
+    PidiCmdList         cmds;       // dt is relative to the previous cmd of the same track
+    AIL_DA(u64)         starts;     // Absolute start-time (in ms) of each cmd - only filled if starts.data is allocated
+} MidiTrackCursor;
+AIL_DA_INIT(MidiTrackCursor);
+
+// Incremental decoder, that emits the cmds of all tracks in order of time before the whole file was decoded
+// The tracks are kept in a min-heap keyed on what needs to happen next for each track (see midi_stream_key)
+typedef struct MidiStream {
+    MidiTempoMap            tempo_map;
+    AIL_DA(MidiTrackCursor) tracks;
+    u32                    *heads;    // Index of the next cmd to be emitted for each track
+    u64                    *keys;     // Key of each track in the heap
+    u32                    *heap;     // Indexes of all tracks, that have cmds left to decode or emit
+    u32                     heap_len;
+    u64                     cur_time; // Absolute start-time (in ms) of the last emitted cmd
+    u64                     song_len; // Length (in ms) of the song up to the last emitted cmd
+} MidiStream;
+
+// Shared state of the threads parsing the tracks of a single file
+typedef struct MidiParseJobs {
+    AIL_Buffer            buffer;
+    const MidiTrackChunk *chunks;
+    const MidiTempoMap   *tempo_map;
+    PidiCmdList          *out;   // Parsed commands of each track (preallocated with the exact capacity)
+    u32                   count; // Amount of tracks
+    u32                   next;  // Index of the next track to be parsed
+    pthread_mutex_t       mutex; // Protects next
+} MidiParseJobs;
+
 
 u32 read_var_len(AIL_Buffer *buffer);
-ParseMidiRes parse_midi(AIL_Buffer buffer);
+bool midi_prescan(AIL_Buffer buffer, u16 ntrcks, u16 ticksPQN, MidiTempoMap *map, AIL_DA(MidiTrackChunk) *chunks);
+u64  midi_ticks_to_ms(const MidiTempoMap *map, u64 tick);
+void midi_track_cursor_init(MidiTrackCursor *cursor, AIL_Buffer buffer, MidiTrackChunk chunk, const MidiTempoMap *tempo_map, PidiCmdList cmds);
+bool midi_track_step(MidiTrackCursor *cursor);
+PidiCmdList parse_midi_track(AIL_Buffer buffer, MidiTrackChunk chunk, const MidiTempoMap *tempo_map, PidiCmdList cmds);
+void *midi_parse_worker(void *arg);
+bool midi_open(AIL_Buffer buffer, MidiTempoMap *tempo_map, AIL_DA(MidiTrackChunk) *track_chunks, char *err);
+ParseMidiRes parse_midi(AIL_Buffer buffer, AIL_Allocator *allocator);
+bool midi_stream_open(MidiStream *stream, AIL_Buffer buffer, char *err);
+u32  midi_stream_next(MidiStream *stream, PidiCmd *out, u32 max);
+void midi_stream_close(MidiStream *stream);
 void write_midi(Song song, const char *fpath);
-void sort_chunks(AIL_DA(PidiCmd) cmds);
+void sort_timed_cmds(PidiCmdTimed *cmds, PidiCmdTimed *tmp, u32 len);
 void write_timed_midi(const PidiCmdTimed *cmds, u32 len, const char *fpath);
 
 
-ParseMidiRes merge_sorted_chunks(AIL_DA(PidiCmdList) chunks, u64 *start_times) {
+// Returns true if the next command of track a should be merged before the one of track b
+// Ties are broken by the track's index to keep the merge stable
+static inline bool merge_heap_less(u32 a, u32 b, const u64 *next_times)
+{
+    return next_times[a] < next_times[b] || (next_times[a] == next_times[b] && a < b);
+}
+
+static inline void merge_heap_sift_down(u32 *heap, u32 len, u32 i, const u64 *next_times)
+{
+    while (true) {
+        u32 l   = 2*i + 1;
+        u32 r   = l + 1;
+        u32 min = i;
+        if (l < len && merge_heap_less(heap[l], heap[min], next_times)) min = l;
+        if (r < len && merge_heap_less(heap[r], heap[min], next_times)) min = r;
+        if (min == i) break;
+        AIL_SWAP_PORTABLE(u32, heap[i], heap[min]);
+        i = min;
+    }
+}
+
+// Merges the commands of all chunks into a single list, that is sorted by time
+// The merge is done with a min-heap over the tracks, keyed on the absolute time of each track's next command,
+// so that picking the next command is O(log(chunks.len)) instead of O(chunks.len)
+// The resulting list is allocated with allocator and has exactly the needed capacity
+ParseMidiRes merge_sorted_chunks(AIL_DA(PidiCmdList) chunks, u64 *start_times, AIL_Allocator *allocator) {
     ParseMidiResVal res = {0};
     u32 total_count = 0;
     for (u32 i = 0; i < chunks.len; i++) total_count += chunks.data[i].len;
-    AIL_DA(PidiCmd) cmds = ail_da_new_with_cap(PidiCmd, total_count);
-    cmds.len = total_count;
-    u32 *indices = calloc(chunks.len, sizeof(u32));
+    PidiCmd *cmds_data = total_count ? allocator->alloc(allocator->data, total_count*sizeof(PidiCmd)) : NULL;
+    AIL_DA(PidiCmd) cmds = ail_da_from_parts(PidiCmd, cmds_data, total_count, total_count, allocator);
+    u32 *indices    = calloc(chunks.len, sizeof(u32));
+    u64 *next_times = malloc(chunks.len * sizeof(u64)); // Start-Time (in ms) of the next command of each track
+    u32 *heap       = malloc(chunks.len * sizeof(u32));
+    u32  heap_len   = 0;
     u64 cur_time = 0; // Start-Time (in ms) of the last inserted command
     u64 song_len = 0; // length of song in ms
 
-    for (u32 i = 0; i < total_count; i++) {
-        i32 min = -1;
-        for (i32 j = 0; j < (i32)chunks.len; j++) {
-            if ((indices[j] < chunks.data[j].len) &&
-                ((min < 0) || (start_times[j] + chunks.data[j].data[indices[j]].dt < start_times[min] + chunks.data[min].data[indices[min]].dt))) {
-                min = j;
-            }
+    for (u32 j = 0; j < chunks.len; j++) {
+        if (chunks.data[j].len) {
+            next_times[j]    = start_times[j] + chunks.data[j].data[0].dt;
+            heap[heap_len++] = j;
         }
-        AIL_ASSERT(min >= 0);
-        start_times[min] += chunks.data[min].data[indices[min]].dt;
-        cmds.data[i]    = chunks.data[min].data[indices[min]];
+    }
+    for (u32 i = heap_len/2; i-- > 0;) merge_heap_sift_down(heap, heap_len, i, next_times);
+
+    for (u32 i = 0; i < total_count; i++) {
+        AIL_ASSERT(heap_len > 0);
+        u32 min = heap[0];
+        start_times[min] = next_times[min];
+        cmds.data[i]     = chunks.data[min].data[indices[min]];
         AIL_ASSERT(start_times[min] >= cur_time);
-        cmds.data[i].dt = start_times[min] - cur_time;
-        cur_time       += cmds.data[i].dt;
-        song_len        = AIL_MAX(song_len, cur_time + cmds.data[i].len*LEN_FACTOR);
+        cmds.data[i].dt  = start_times[min] - cur_time;
+        cur_time        += cmds.data[i].dt;
+        song_len         = AIL_MAX(song_len, cur_time + cmds.data[i].len*LEN_FACTOR);
         indices[min]++;
+
+        if (indices[min] < chunks.data[min].len) next_times[min] = start_times[min] + chunks.data[min].data[indices[min]].dt;
+        else heap[0] = heap[--heap_len];
+        merge_heap_sift_down(heap, heap_len, 0, next_times);
     }
 
+    free(heap);
+    free(next_times);
     free(indices);
     res.song.cmds = cmds;
     res.song.len  = song_len;
-    return (ParseMidiRes) {true, res};
+    MidiParseStats stats = { .scratch = 0, .song = (u64)total_count*sizeof(PidiCmd) };
+    return (ParseMidiRes) {true, res, stats};
+}
+
+// Sets the length of the open note and marks it as closed
+static inline void midi_close_note(PidiCmdList *chunk, MidiOpenNote *note, u64 end_ms)
+{
+    u64 len = end_ms - note->start_ms;
+    chunk->data[note->idx].len = (len + LEN_FACTOR/2)/LEN_FACTOR; // +LEN_FACTOR/2 to do rounding
+    note->open = false;
+}
+
+// Bounds-checked reads for parsing
+// Reading past the end of the buffer returns 0 but still advances the cursor, so that the overflow can be detected afterwards by checking buffer.idx
+static inline u8 midi_peek1(AIL_Buffer buffer)
+{
+    return buffer.idx < buffer.len ? buffer.data[buffer.idx] : 0;
+}
+
+static inline u8 midi_read1(AIL_Buffer *buffer)
+{
+    u8 x = midi_peek1(*buffer);
+    buffer->idx++;
+    return x;
+}
+
+static inline u16 midi_read2msb(AIL_Buffer *buffer)
+{
+    u16 x = (u16)midi_read1(buffer) << 8;
+    return x | midi_read1(buffer);
 }
 
-// Code taken from MIDI Standard
+static inline u32 midi_read3msb(AIL_Buffer *buffer)
+{
+    u32 x = (u32)midi_read2msb(buffer) << 8;
+    return x | midi_read1(buffer);
+}
+
+static inline u32 midi_read4msb(AIL_Buffer *buffer)
+{
+    u32 x = (u32)midi_read2msb(buffer) << 16;
+    return x | midi_read2msb(buffer);
+}
+
+// Reads a variable-length quantity
+// If at least 16 bytes are left, the last byte of the quantity is found with a single movemask and its (at most 4) bytes are combined without branching
+// Otherwise (or if the quantity is longer than allowed) the code taken from the MIDI Standard is used
 u32 read_var_len(AIL_Buffer *buffer)
 {
+#ifdef MIDI_USE_SSE2
+    if (AIL_LIKELY(buffer->idx + 16 <= buffer->len)) {
+        const u8 *p    = &buffer->data[buffer->idx];
+        u32       cont = (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)); // Bit i is set if byte i has its continuation-bit set
+        u32       n    = __builtin_ctz(~cont) + 1; // Amount of bytes in the quantity
+        if (AIL_LIKELY(n <= 4)) {
+            u32 x = ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+            x >>= (4 - n)*8;
+            buffer->idx += n;
+            return (x & 0x7f) | ((x >> 1) & 0x3f80) | ((x >> 2) & 0x1fc000) | ((x >> 3) & 0xfe00000);
+        }
+    }
+#endif
     u32 value;
     u8 c;
-    if ((value = ail_buf_read1(buffer)) & 0x80) {
+    // @Note: midi_read1 returns 0 when reading out of bounds, which ends the loop
+    if ((value = midi_read1(buffer)) & 0x80) {
         value &= 0x7f;
         do {
-            value = (value << 7) + ((c = ail_buf_read1(buffer)) & 0x7f);
+            value = (value << 7) + ((c = midi_read1(buffer)) & 0x7f);
         } while (c & 0x80); }
     return value;
 }
 
-ParseMidiRes parse_midi(AIL_Buffer buffer)
+typedef struct MidiTempoEvent {
+    u64 tick;
+    u32 tempo;
+    u32 order; // Index of the event in the file, to keep the sort stable
+} MidiTempoEvent;
+AIL_DA_INIT(MidiTempoEvent);
+
+static int midi_tempo_event_cmp(const void *a, const void *b)
 {
-    ParseMidiResVal val = {0};
-    #define midiFileStartLen 8
-    const char midiFileStart[midiFileStartLen] = {'M', 'T', 'h', 'd', 0, 0, 0, 6};
+    const MidiTempoEvent *x = a;
+    const MidiTempoEvent *y = b;
+    if (x->tick != y->tick) return x->tick < y->tick ? -1 : 1;
+    return (x->order > y->order) - (x->order < y->order);
+}
 
-    if (buffer.len < 14 || memcmp(buffer.data, midiFileStart, midiFileStartLen) != 0) {
-        sprintf(val.err, "Invalid Midi File provided.\nMake sure the File wasn't corrupted\n");
-        return (ParseMidiRes) { false, val };
+// Walks over all track chunks (starting at buffer.idx), records the position of each chunk in chunks and collects all Set Tempo events into map
+// Returns false if the chunks are malformed
+bool midi_prescan(AIL_Buffer buffer, u16 ntrcks, u16 ticksPQN, MidiTempoMap *map, AIL_DA(MidiTrackChunk) *chunks)
+{
+    AIL_DA(MidiTempoEvent) events = ail_da_new(MidiTempoEvent);
+    *chunks = ail_da_new_with_cap(MidiTrackChunk, ntrcks);
+    bool succ = true;
+    for (u16 i = 0; succ && i < ntrcks; i++) {
+        if (buffer.idx + 8 > buffer.len || midi_read4msb(&buffer) != 0x4D54726B) { succ = false; break; }
+        u32 chunk_len = midi_read4msb(&buffer);
+        u64 chunk_end = buffer.idx + chunk_len;
+        if (chunk_end > buffer.len) { succ = false; break; }
+        MidiTrackChunk chunk = { .offset = buffer.idx, .len = chunk_len, .notes = 0 };
+        u64 tick    = 0;
+        u8  command = 0; // used in running status
+        while (buffer.idx < chunk_end) {
+            tick += read_var_len(&buffer);
+            u8 status = midi_peek1(buffer);
+            if (status == 0xff) {
+                buffer.idx++;
+                u8  type = midi_read1(&buffer);
+                u32 len  = read_var_len(&buffer);
+                if (type == 0x51 && len == 3) {
+                    MidiTempoEvent ev = { .tick = tick, .tempo = midi_read3msb(&buffer), .order = events.len };
+                    ail_da_push(&events, ev);
+                } else buffer.idx += len;
+            } else if (status == 0xf0 || status == 0xf7) { // SysEx Event
+                buffer.idx++;
+                buffer.idx += read_var_len(&buffer);
+            } else {
+                if (status & 0x80) {
+                    command = status >> 4;
+                    buffer.idx++;
+                }
+                if (command == 0x8 || command == 0x9) {
+                    // Notes and velocities can't have their first bit set - they would index past the open notes of a track
+                    if (buffer.idx + 1 >= buffer.len || ((buffer.data[buffer.idx] | buffer.data[buffer.idx + 1]) & 0x80)) { succ = false; break; }
+                    if (command == 0x9 && buffer.data[buffer.idx + 1]) chunk.notes++; // Note-ons with a velocity of 0 are note-offs
+                }
+                buffer.idx += (command == 0xC || command == 0xD) ? 1 : 2;
+            }
+        }
+        if (buffer.idx != chunk_end) succ = false;
+        ail_da_push(chunks, chunk);
     }
-    buffer.idx += midiFileStartLen;
 
-    u32 tempo = 500000; // in ms. 500000ms = 120BPM (default value)
-    u16 format   = ail_buf_read2msb(&buffer);
-    u16 ntrcks   = ail_buf_read2msb(&buffer);
-    u16 ticksPQN = ail_buf_read2msb(&buffer);
-    if (ticksPQN & 0x8000) {
-        // If first bit is set, a different encoding is used for some reason
-        AIL_TODO();
+    qsort(events.data, events.len, sizeof(MidiTempoEvent), midi_tempo_event_cmp);
+    map->ticksPQN = ticksPQN;
+    map->segs     = ail_da_new_with_cap(MidiTempoSegment, events.len + 1);
+    MidiTempoSegment first = { .tick = 0, .time = 0, .tempo = MIDI_DEFAULT_TEMPO };
+    ail_da_push(&map->segs, first);
+    for (u32 i = 0; i < events.len; i++) {
+        MidiTempoSegment *last = &map->segs.data[map->segs.len - 1];
+        if (events.data[i].tick == last->tick) {
+            last->tempo = events.data[i].tempo; // Later events at the same tick override earlier ones
+        } else {
+            MidiTempoSegment seg = {
+                .tick  = events.data[i].tick,
+                .time  = last->time + (events.data[i].tick - last->tick)*last->tempo,
+                .tempo = events.data[i].tempo,
+            };
+            ail_da_push(&map->segs, seg);
+        }
     }
+    ail_da_free(&events);
+    return succ;
+}
 
-    // DBG_LOG("format: %d, ntrcks: %d, ticks per quarter-note: %d\n", format, ntrcks, ticksPQN);
+// Converts an absolute tick into an absolute time in ms
+// The segment is found via binary search and the time is calculated in integers only, so no error accumulates over the song
+u64 midi_ticks_to_ms(const MidiTempoMap *map, u64 tick)
+{
+    u32 lo = 0, hi = map->segs.len;
+    while (hi - lo > 1) {
+        u32 mid = lo + (hi - lo)/2;
+        if (map->segs.data[mid].tick <= tick) lo = mid;
+        else hi = mid;
+    }
+    const MidiTempoSegment *seg = &map->segs.data[lo];
+    u64 time = seg->time + (tick - seg->tick)*seg->tempo;
+    return (time + map->ticksPQN*500) / ((u64)map->ticksPQN*1000); // +ticksPQN*500 to do rounding
+}
 
-    if (format > 2) {
-        sprintf(val.err, "Unknown Midi Format.\nPlease try a different Midi File\n");
-        return (ParseMidiRes) { false, val };
+// Starts decoding the track chunk from buffer
+// The decoded cmds are pushed onto cmds, which should be empty
+void midi_track_cursor_init(MidiTrackCursor *cursor, AIL_Buffer buffer, MidiTrackChunk chunk, const MidiTempoMap *tempo_map, PidiCmdList cmds)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->buffer     = buffer;
+    cursor->buffer.idx = chunk.offset;
+    cursor->chunk_end  = chunk.offset + chunk.len;
+    cursor->tempo_map  = tempo_map;
+    cursor->cmds       = cmds;
+}
+
+// Handles a note-on/-off event (depending on cursor->command) at cursor->tick
+// The prescan rejects tracks with invalid notes, but the first bit is still cleared, so that a note can never index past open_notes
+static inline void midi_track_note(MidiTrackCursor *cursor, u8 note, u8 velocity)
+{
+    note     &= 0x7f;
+    velocity &= 0x7f;
+    i8 octave  = MIDI_NOTE_TO_OCTAVE(note);
+    // DBG_LOG("octave: %d\n", octave);
+    u8 key     = MIDI_NOTE_TO_KEY(note);
+    u64 now_ms = midi_ticks_to_ms(cursor->tempo_map, cursor->tick);
+    MidiOpenNote *open_note = &cursor->open_notes[MIDI_OPEN_NOTE_IDX(octave, key)];
+    if (cursor->command == 0x8 || !velocity) { // Note off
+        // DBG_LOG("Note off: key=%d, octave=%d\n", key, octave);
+        // Note-offs without a matching note-on are ignored
+        if (open_note->open) midi_close_note(&cursor->cmds, open_note, now_ms);
+    } else { // Note on
+        // If the key is still being played, it is released and struck again
+        if (open_note->open) midi_close_note(&cursor->cmds, open_note, now_ms);
+        PidiCmd cmd = {
+            .dt       = now_ms - cursor->last_on_ms,
+            .velocity = AIL_LERP((f32)velocity/MIDI_MAX_VELOCITY, 0, MAX_VELOCITY),
+            .len      = 0,
+            .octave   = octave,
+            .key      = key,
+        };
+        open_note->idx      = cursor->cmds.len;
+        open_note->start_ms = now_ms;
+        open_note->open     = true;
+        ail_da_push(&cursor->cmds, cmd);
+        if (cursor->starts.data) ail_da_push(&cursor->starts, now_ms);
+        // DBG_LOG("\033[32mNote on: \033[0m");
+        // print_cmd(cmd);
+        cursor->last_on_ms = now_ms;
     }
+}
 
-    AIL_DA(PidiCmdList) pidi_chunks = ail_da_new_with_cap(PidiCmdList, ntrcks);
-    AIL_DA(u64)         start_times = ail_da_new_with_cap(u64, ntrcks);
-    for (u16 i = 0; i < ntrcks; i++) {
-        u8 command = 0; // used in running status (@Note: status == command)
-        u8 channel = 0; // used in running status
-        u32 last_cmd_dt = 0;
-        AIL_UNUSED(channel);
-        // Parse track cmds
-        AIL_ASSERT(ail_buf_read4msb(&buffer) == 0x4D54726B);
-        u32 chunk_len   = ail_buf_read4msb(&buffer);
-        u32 chunk_end   = buffer.idx + chunk_len;
-        AIL_DA(PidiCmd) pidi_chunk = ail_da_new_with_cap(PidiCmd, chunk_len/MIDI_MIN_CMD_SIZE);
-        // DBG_LOG("Parsing cmd from %#010llx to %#010x\n", buffer.idx, chunk_end);
-        while (buffer.idx < chunk_end) {
-            // Parse MTrk events
-            u32 delta_time  = read_var_len(&buffer);
-            last_cmd_dt    += delta_time;
-            // DBG_LOG("index: %#010llx, delta_time: %d\n", buffer.idx, delta_time);
-            if (ail_buf_peek1(buffer) == 0xff) {
-                buffer.idx++;
-                // Meta Event
-                switch (ail_buf_read1(&buffer)) {
-                    case 0x00: { // Sequence Number - ignored
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 2);
-                        buffer.idx += 2;
-                    } break;
-                    case 0x01:   // Text Event          - ignored
-                    case 0x02:   // Copyright Notice    - ignored
-                    case 0x03:   // Sequence/Track Name - ignored
-                    case 0x04:   // Instrument Name     - ignored
-                    case 0x05:   // Lyric               - ignored
-                    case 0x06:   // Marker              - ignored
-                    case 0x07: { // Cue Point           - ignored
-                        u32 len = read_var_len(&buffer);
-                        buffer.idx += len;
-                    } break;
-                    case 0x20: { // MIDI Channel Prefix - ignored for now
-                        // @Note: This secified that the next events only effect this specific channel
-                        // @TODO: This should be handled if there are any events that may effect one channel and should not effect the notes from other channels
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 1);
-                        buffer.idx++;
-                    } break;
-                    case 0x2f: { // End of Track - ignored
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 0);
-                        AIL_ASSERT(buffer.idx == chunk_end);
-                    } break;
-                    case 0x51: { // Set Tempo
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 3);
-                        // u32 x = ail_buf_read3msb(&buffer);
-                        tempo = ail_buf_read3msb(&buffer);
-                        // DBG_LOG("tempo: %u\n", tempo);
-                    } break;
-                    case 0x54: { // SMPTE Offset
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 5);
-                        u8 hr = ail_buf_read1(&buffer);
-                        u8 mn = ail_buf_read1(&buffer);
-                        u8 se = ail_buf_read1(&buffer);
-                        u8 fr = ail_buf_read1(&buffer);
-                        u8 ff = ail_buf_read1(&buffer);
-                        // > This event, if present, designates the SMPTE time at which the track cmd is supposed to start
-                        // @Study: Can we ignore this event?
-                        DBG_LOG("SMPTE - hour: %u, min: %u, sec: %u, fr: %u, ff: %u\n", hr, mn, se, fr, ff);
+// Decodes the next event of the track
+// Returns false once the end of the track was reached, at which point all notes that are still open get closed
+bool midi_track_step(MidiTrackCursor *cursor)
+{
+    if (cursor->buffer.idx >= cursor->chunk_end) {
+        if (!cursor->done) {
+            // Notes that were never turned off are played until the end of the track
+            u64 end_ms = midi_ticks_to_ms(cursor->tempo_map, cursor->tick);
+            for (u32 k = 0; k < MIDI_NOTES_AMOUNT; k++) {
+                if (cursor->open_notes[k].open) midi_close_note(&cursor->cmds, &cursor->open_notes[k], end_ms);
+            }
+            cursor->done = true;
+        }
+        return false;
+    }
+    // Parse MTrk events
+    u32 delta_time  = read_var_len(&cursor->buffer);
+    cursor->tick   += delta_time;
+    // DBG_LOG("index: %#010llx, delta_time: %d\n", cursor->buffer.idx, delta_time);
+    // Fast path for notes using the running status, which make up most events of a typical file
+    if (AIL_LIKELY((cursor->command == 0x8 || cursor->command == 0x9) && cursor->buffer.idx + 2 <= cursor->buffer.len && !(cursor->buffer.data[cursor->buffer.idx] & 0x80))) {
+        const u8 *p = &cursor->buffer.data[cursor->buffer.idx];
+        cursor->buffer.idx += 2;
+        midi_track_note(cursor, p[0], p[1]);
+        return true;
+    }
+    if (midi_peek1(cursor->buffer) == 0xff) {
+        cursor->buffer.idx++;
+        // Meta Event
+        switch (midi_read1(&cursor->buffer)) {
+            case 0x00: { // Sequence Number - ignored
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 2);
+                cursor->buffer.idx += 2;
+            } break;
+            case 0x01:   // Text Event          - ignored
+            case 0x02:   // Copyright Notice    - ignored
+            case 0x03:   // Sequence/Track Name - ignored
+            case 0x04:   // Instrument Name     - ignored
+            case 0x05:   // Lyric               - ignored
+            case 0x06:   // Marker              - ignored
+            case 0x07: { // Cue Point           - ignored
+                u32 len = read_var_len(&cursor->buffer);
+                cursor->buffer.idx += len;
+            } break;
+            case 0x20: { // MIDI Channel Prefix - ignored for now
+                // @Note: This secified that the next events only effect this specific channel
+                // @TODO: This should be handled if there are any events that may effect one channel and should not effect the notes from other channels
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 1);
+                cursor->buffer.idx++;
+            } break;
+            case 0x2f: { // End of Track - ignored
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 0);
+                AIL_ASSERT(cursor->buffer.idx == cursor->chunk_end);
+            } break;
+            case 0x51: { // Set Tempo - already handled by the tempo map
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 3);
+                cursor->buffer.idx += 3;
+            } break;
+            case 0x54: { // SMPTE Offset
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 5);
+                u8 hr = midi_read1(&cursor->buffer);
+                u8 mn = midi_read1(&cursor->buffer);
+                u8 se = midi_read1(&cursor->buffer);
+                u8 fr = midi_read1(&cursor->buffer);
+                u8 ff = midi_read1(&cursor->buffer);
+                // > This event, if present, designates the SMPTE time at which the track cmd is supposed to start
+                // @Study: Can we ignore this event?
+                DBG_LOG("SMPTE - hour: %u, min: %u, sec: %u, fr: %u, ff: %u\n", hr, mn, se, fr, ff);
+                AIL_TODO();
+            } break;
+            case 0x58: { // Time Signature - ignored
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 4);
+                cursor->buffer.idx += 2; // ignore num/den
+                // ticksPQN = midi_read1(&cursor->buffer);
+                // u8 b = midi_read1(&cursor->buffer);
+                // DBG_LOG("b: %u\n", b); // @Bug
+                cursor->buffer.idx += 2;
+                // AIL_ASSERT(b == 8); // It would be weird if there's not exactly 8 32nd notes ber quarter-note
+            } break;
+            case 0x59: { // Key Signature - ignored
+                AIL_ASSERT(midi_read1(&cursor->buffer) == 2);
+                cursor->buffer.idx += 2;
+            } break;
+            case 0x7f: { // Sequencer-Specific Meta-Event - ignored
+                u32 len = read_var_len(&cursor->buffer);
+                cursor->buffer.idx += len;
+            } break;
+            default: {
+                cursor->buffer.idx -= 2;
+                u16 ev = midi_read2msb(&cursor->buffer);
+                DBG_LOG("\033[33mEncountered unknown meta event %#04x.\033[0m\n", ev);
+                u32 len = read_var_len(&cursor->buffer);
+                cursor->buffer.idx += len;
+            }
+        }
+    }
+    else {
+        // If current byte doesn't start with a 1, the running status is used
+        if (midi_peek1(cursor->buffer) & 0x80) {
+            cursor->command = (midi_peek1(cursor->buffer) & 0xf0) >> 4;
+            cursor->channel = midi_read1(&cursor->buffer) & 0x0f;
+            // DBG_LOG("New Status - ");
+        } else {
+            // DBG_LOG("Running Status - ");
+        }
+        // DBG_LOG("Command: %#01x, Channel: %#01x\n", cursor->command, cursor->channel);
+        switch (cursor->command) {
+            case 0x8:
+            case 0x9: { // Note off/on
+                u8 note     = midi_read1(&cursor->buffer);
+                u8 velocity = midi_read1(&cursor->buffer);
+                midi_track_note(cursor, note, velocity);
+            } break;
+            case 0xA: { // Polyphonic Key Pressure
+                AIL_TODO();
+            } break;
+            case 0xB: { // Control Change
+                u8 c = midi_read1(&cursor->buffer);
+                u8 v = midi_read1(&cursor->buffer);
+                DBG_LOG("Control Change: c = %#01x, v = %#01x\n", c, v);
+                AIL_ASSERT(v <= 127);
+                if (c < 120) {
+                    // Do nothing for now
+                    // @TODO: Check if any messages here might be interesting for us
+                } else switch (c) {
+                    case 120: { // All Sound off @TODO
                         AIL_TODO();
                     } break;
-                    case 0x58: { // Time Signature - ignored
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 4);
-                        buffer.idx += 2; // ignore num/den
-                        // ticksPQN = ail_buf_read1(&buffer);
-                        // u8 b = ail_buf_read1(&buffer);
-                        // DBG_LOG("b: %u\n", b); // @Bug
-                        buffer.idx += 2;
-                        // AIL_ASSERT(b == 8); // It would be weird if there's not exactly 8 32nd notes ber quarter-note
-                    } break;
-                    case 0x59: { // Key Signature - ignored
-                        AIL_ASSERT(ail_buf_read1(&buffer) == 2);
-                        buffer.idx += 2;
-                    } break;
-                    case 0x7f: { // Sequencer-Specific Meta-Event - ignored
-                        u32 len = read_var_len(&buffer);
-                        buffer.idx += len;
-                    } break;
-                    default: {
-                        buffer.idx -= 2;
-                        u16 ev = ail_buf_read2msb(&buffer);
-                        DBG_LOG("\033[33mEncountered unknown meta event %#04x.\033[0m\n", ev);
-                        u8 len = ail_buf_read1(&buffer);
-                        buffer.idx += len;
-                    }
-                }
-            }
-            else {
-                // If current byte doesn't start with a 1, the running status is used
-                if (ail_buf_peek1(buffer) & 0x80) {
-                    command = (ail_buf_peek1(buffer) & 0xf0) >> 4;
-                    channel = ail_buf_read1(&buffer) & 0x0f;
-                    // DBG_LOG("New Status - ");
-                } else {
-                    // DBG_LOG("Running Status - ");
-                }
-                // DBG_LOG("Command: %#01x, Channel: %#01x\n", command, channel);
-                switch (command) {
-                    case 0x8:
-                    case 0x9: { // Note off/on
-                        u8 note     = ail_buf_read1(&buffer);
-                        u8 velocity = ail_buf_read1(&buffer);
-                        i8 octave   = MIDI_NOTE_TO_OCTAVE(note);
-                        // DBG_LOG("octave: %d\n", octave);
-                        u8 key      = MIDI_NOTE_TO_KEY(note);
-                        if (command == 0x8 || !velocity) { // Note off
-                            u16 len     = MIDI_TICKS_TO_MS(last_cmd_dt, tempo, ticksPQN);
-                            // DBG_LOG("Note off: key=%d, octave=%d, len=%d\n", key, octave, len);
-                            for (u32 k = pidi_chunk.len - 1; k < pidi_chunk.len; k--) {
-                                PidiCmd *cmd = &pidi_chunk.data[k];
-                                if (pidi_key(*cmd) == key && pidi_octave(*cmd) == octave) {
-                                    cmd->len = (len + LEN_FACTOR/2)/LEN_FACTOR; // +LEN_FACTOR/2 to do rounding
-                                    // DBG_LOG("Found note: ");
-                                    // print_cmd(*cmd);
-                                    break;
-                                } else {
-                                    len += cmd->dt;
-                                }
-                            }
-                        } else { // Note on
-                            PidiCmd cmd = {
-                                .dt       = MIDI_TICKS_TO_MS(last_cmd_dt, tempo, ticksPQN),
-                                .velocity = AIL_LERP((f32)velocity/MIDI_MAX_VELOCITY, 0, MAX_VELOCITY),
-                                .len      = 0,
-                                .octave   = octave,
-                                .key      = key,
-                            };
-                            ail_da_push(&pidi_chunk, cmd);
-                            // DBG_LOG("\033[32mNote on: \033[0m");
-                            // print_cmd(cmd);
-                            last_cmd_dt = 0;
-                        }
+                    case 121: { // Reset all controllers - ignored
                     } break;
-                    case 0xA: { // Polyphonic Key Pressure
+                    case 122: {
                         AIL_TODO();
                     } break;
-                    case 0xB: { // Control Change
-                        u8 c = ail_buf_read1(&buffer);
-                        u8 v = ail_buf_read1(&buffer);
-                        DBG_LOG("Control Change: c = %#01x, v = %#01x\n", c, v);
-                        AIL_ASSERT(v <= 127);
-                        if (c < 120) {
-                            // Do nothing for now
-                            // @TODO: Check if any messages here might be interesting for us
-                        } else switch (c) {
-                            case 120: { // All Sound off @TODO
-                                AIL_TODO();
-                            } break;
-                            case 121: { // Reset all controllers - ignored
-                            } break;
-                            case 122: {
-                                AIL_TODO();
-                            } break;
-                            case 123: { // All Notes off
-                                AIL_TODO();
-                            } break;
-                            case 124: {
-                                AIL_TODO();
-                            } break;
-                            case 125: {
-                                AIL_TODO();
-                            } break;
-                            case 126: {
-                                AIL_TODO();
-                            } break;
-                            case 127: {
-                                AIL_TODO();
-                            } break;
-                            default: AIL_UNREACHABLE();
-                        }
+                    case 123: { // All Notes off
+                        AIL_TODO();
                     } break;
-                    case 0xC: { // Program Change - ignored
-                        u8 patch = ail_buf_read1(&buffer);
-                        DBG_LOG("Program Change: patch = %d\n", patch);
-                        // Do nothing
+                    case 124: {
+                        AIL_TODO();
                     } break;
-                    case 0xD: { // Channel Pressure
+                    case 125: {
                         AIL_TODO();
                     } break;
-                    case 0xE: { // Pitch Bend Change
+                    case 126: {
                         AIL_TODO();
                     } break;
-                    case 0xF: { // System Common Messages
+                    case 127: {
                         AIL_TODO();
                     } break;
+                    default: AIL_UNREACHABLE();
+                }
+            } break;
+            case 0xC: { // Program Change - ignored
+                u8 patch = midi_read1(&cursor->buffer);
+                DBG_LOG("Program Change: patch = %d\n", patch);
+                // Do nothing
+            } break;
+            case 0xD: { // Channel Pressure
+                AIL_TODO();
+            } break;
+            case 0xE: { // Pitch Bend Change
+                AIL_TODO();
+            } break;
+            case 0xF: { // System Common Messages
+                AIL_TODO();
+            } break;
+        }
+    }
+    return true;
+}
+
+// Parses the events of a single track chunk into a list of commands
+// The dt of each command is relative to the previous command in the same track
+// Only reads from buffer and tempo_map, so that several tracks can be parsed at the same time
+// cmds should have a capacity of at least chunk.notes, so that it never needs to grow
+PidiCmdList parse_midi_track(AIL_Buffer buffer, MidiTrackChunk chunk, const MidiTempoMap *tempo_map, PidiCmdList cmds)
+{
+    MidiTrackCursor cursor;
+    midi_track_cursor_init(&cursor, buffer, chunk, tempo_map, cmds);
+    while (midi_track_step(&cursor)) {}
+    AIL_ASSERT(cursor.cmds.len == chunk.notes);
+    return cursor.cmds;
+}
+
+// Parses the tracks from jobs->chunks until no tracks are left
+void *midi_parse_worker(void *arg)
+{
+    MidiParseJobs *jobs = arg;
+    while (true) {
+        while (pthread_mutex_lock(&jobs->mutex) != 0) {}
+        u32 i = jobs->next++;
+        while (pthread_mutex_unlock(&jobs->mutex) != 0) {}
+        if (i >= jobs->count) break;
+        jobs->out[i] = parse_midi_track(jobs->buffer, jobs->chunks[i], jobs->tempo_map, jobs->out[i]);
+    }
+    return NULL;
+}
+
+// Checks the header of the MIDI file in buffer and prescans all of its tracks
+// On failure, an error message is written into err (which needs to be able to hold at least 256 characters)
+bool midi_open(AIL_Buffer buffer, MidiTempoMap *tempo_map, AIL_DA(MidiTrackChunk) *track_chunks, char *err)
+{
+    #define midiFileStartLen 8
+    const char midiFileStart[midiFileStartLen] = {'M', 'T', 'h', 'd', 0, 0, 0, 6};
+
+    if (buffer.len < 14 || memcmp(buffer.data, midiFileStart, midiFileStartLen) != 0) {
+        sprintf(err, "Invalid Midi File provided.\nMake sure the File wasn't corrupted\n");
+        return false;
+    }
+    buffer.idx += midiFileStartLen;
+
+    u16 format   = midi_read2msb(&buffer);
+    u16 ntrcks   = midi_read2msb(&buffer);
+    u16 ticksPQN = midi_read2msb(&buffer);
+    if (ticksPQN & 0x8000) {
+        // If first bit is set, a different encoding is used for some reason
+        AIL_TODO();
+    }
+    if (!ticksPQN) {
+        // Every time in the file would be a division by 0
+        sprintf(err, "Invalid Midi File provided.\nMake sure the File wasn't corrupted\n");
+        return false;
+    }
+
+    // DBG_LOG("format: %d, ntrcks: %d, ticks per quarter-note: %d\n", format, ntrcks, ticksPQN);
+
+    if (format > 2) {
+        sprintf(err, "Unknown Midi Format.\nPlease try a different Midi File\n");
+        return false;
+    }
+
+    if (!midi_prescan(buffer, ntrcks, ticksPQN, tempo_map, track_chunks)) {
+        ail_da_free(track_chunks);
+        ail_da_free(&tempo_map->segs);
+        sprintf(err, "Invalid Midi File provided.\nMake sure the File wasn't corrupted\n");
+        return false;
+    }
+    return true;
+}
+
+// Parses the MIDI file in buffer
+// buffer is only read from, so it can be a read-only view of a mapped file (see fmap.c)
+// Only the resulting list of commands is allocated with allocator, all other memory is released before returning
+ParseMidiRes parse_midi(AIL_Buffer buffer, AIL_Allocator *allocator)
+{
+    ParseMidiResVal val = {0};
+    MidiTempoMap tempo_map;
+    AIL_DA(MidiTrackChunk) track_chunks;
+    if (!midi_open(buffer, &tempo_map, &track_chunks, val.err)) return (ParseMidiRes) { false, val, {0} };
+
+    // The prescan counted the notes of each track, so the scratch memory for parsing is known in advance
+    // All of it lives in a single arena, that is released at once after merging
+    u32 ntracks      = track_chunks.len;
+    u64 scratch_size = ntracks*(sizeof(PidiCmdList) + sizeof(u64)) + (ntracks + 2)*MIDI_ARENA_ALIGN;
+    for (u32 i = 0; i < ntracks; i++) scratch_size += track_chunks.data[i].notes*sizeof(PidiCmd);
+    AIL_Allocator scratch = ail_alloc_arena_new(scratch_size, &ail_alloc_pager);
+    PidiCmdList *pidi_chunks = scratch.alloc(scratch.data, ntracks*sizeof(PidiCmdList));
+    u64         *start_times = scratch.alloc(scratch.data, ntracks*sizeof(u64));
+    memset(start_times, 0, ntracks*sizeof(u64));
+    for (u32 i = 0; i < ntracks; i++) {
+        u32 notes = track_chunks.data[i].notes;
+        pidi_chunks[i] = ail_da_from_parts(PidiCmd, scratch.alloc(scratch.data, notes*sizeof(PidiCmd)), 0, notes, &scratch);
+    }
+
+    // Tracks are parsed in parallel by up to MIDI_PARSE_THREADS_COUNT threads (including this one)
+    MidiParseJobs jobs = {
+        .buffer    = buffer,
+        .chunks    = track_chunks.data,
+        .tempo_map = &tempo_map,
+        .out       = pidi_chunks,
+        .count     = ntracks,
+        .next      = 0,
+    };
+    pthread_mutex_init(&jobs.mutex, NULL);
+    pthread_t threads[MIDI_PARSE_THREADS_COUNT];
+    u32 threads_count = AIL_MIN(ntracks, MIDI_PARSE_THREADS_COUNT) - (ntracks > 0);
+    for (u32 i = 0; i < threads_count; i++) {
+        if (pthread_create(&threads[i], NULL, midi_parse_worker, &jobs) != 0) {
+            threads_count = i;
+            break;
+        }
+    }
+    midi_parse_worker(&jobs);
+    for (u32 i = 0; i < threads_count; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&jobs.mutex);
+
+    ParseMidiRes res  = merge_sorted_chunks(ail_da_from_parts(PidiCmdList, pidi_chunks, ntracks, ntracks, &scratch), start_times, allocator);
+    res.stats.scratch = scratch_size + track_chunks.cap*sizeof(MidiTrackChunk) + tempo_map.segs.cap*sizeof(MidiTempoSegment);
+    scratch.free_all(scratch.data);
+    ail_da_free(&track_chunks);
+    ail_da_free(&tempo_map.segs);
+    return res;
+}
+
+// Returns true if the cmd at idx is a note, whose note-off event was not decoded yet
+static inline bool midi_track_cmd_is_open(const MidiTrackCursor *cursor, u32 idx)
+{
+    PidiCmd cmd = cursor->cmds.data[idx];
+    const MidiOpenNote *note = &cursor->open_notes[MIDI_OPEN_NOTE_IDX(pidi_octave(cmd), pidi_key(cmd))];
+    return note->open && note->idx == idx;
+}
+
+// Starts decoding the MIDI file in buffer incrementally
+// buffer needs to stay valid and stream must not be moved until midi_stream_close is called
+// On failure, an error message is written into err (which needs to be able to hold at least 256 characters)
+bool midi_stream_open(MidiStream *stream, AIL_Buffer buffer, char *err)
+{
+    memset(stream, 0, sizeof(*stream));
+    AIL_DA(MidiTrackChunk) track_chunks;
+    if (!midi_open(buffer, &stream->tempo_map, &track_chunks, err)) return false;
+    stream->tracks = ail_da_new_with_cap(MidiTrackCursor, AIL_MAX(track_chunks.len, 1));
+    stream->heads  = calloc(AIL_MAX(track_chunks.len, 1), sizeof(u32));
+    stream->keys   = calloc(AIL_MAX(track_chunks.len, 1), sizeof(u64));
+    stream->heap   = malloc(AIL_MAX(track_chunks.len, 1)*sizeof(u32));
+    stream->tracks.len = track_chunks.len;
+    // All tracks start out needing to be decoded at time 0, so the heap is already ordered by the tracks' indexes
+    stream->heap_len   = track_chunks.len;
+    for (u32 i = 0; i < track_chunks.len; i++) stream->heap[i] = i;
+    for (u32 i = 0; i < track_chunks.len; i++) {
+        MidiTrackCursor *track = &stream->tracks.data[i];
+        midi_track_cursor_init(track, buffer, track_chunks.data[i], &stream->tempo_map, ail_da_new_with_cap(PidiCmd, MIDI_STREAM_COMPACT_MIN));
+        // The absolute start-times are kept, since the dt of a cmd overflows if a track pauses for longer than a minute
+        track->starts = ail_da_new_with_cap(u64, MIDI_STREAM_COMPACT_MIN);
+    }
+    ail_da_free(&track_chunks);
+    return true;
+}
+
+// Key of track i in the stream's heap
+// A track, whose next cmd starts before the track's decoded time (its horizon), has the key 2*start + 1 and otherwise the key 2*horizon,
+// so at the root of the heap is either the track with the earliest cmd, if that cmd starts before any track's horizon,
+// or otherwise the track with the earliest horizon, which then needs to be decoded further
+// Returns UINT64_MAX for tracks that are completely decoded and emitted
+static inline u64 midi_stream_key(const MidiStream *stream, u32 i)
+{
+    const MidiTrackCursor *track = &stream->tracks.data[i];
+    u64 horizon = track->done ? UINT64_MAX : midi_ticks_to_ms(&stream->tempo_map, track->tick);
+    if (stream->heads[i] < track->cmds.len && track->starts.data[stream->heads[i]] < horizon) return 2*track->starts.data[stream->heads[i]] + 1;
+    return horizon == UINT64_MAX ? UINT64_MAX : 2*horizon;
+}
+
+// Writes up to max cmds into out, in order of time (dt of the first cmd is relative to the last cmd of the previous call)
+// A cmd is only emitted once every track was decoded past its start-time and once its length is known,
+// so only as much of the file is decoded, as is necessary for the requested cmds
+// Only the track at the root of the heap is decoded or emitted from, and its key can only grow from doing so,
+// so every step is O(log(tracks)) like in merge_sorted_chunks
+// Returns the amount of cmds written - if it's less than max, the whole song was emitted
+u32 midi_stream_next(MidiStream *stream, PidiCmd *out, u32 max)
+{
+    u32 n = 0;
+    while (n < max && stream->heap_len) {
+        u32 first = stream->heap[0];
+        MidiTrackCursor *track = &stream->tracks.data[first];
+        if (!(stream->keys[first] & 1)) {
+            midi_track_step(track); // No track can produce a cmd before this track's horizon
+        } else if (midi_track_cmd_is_open(track, stream->heads[first])) {
+            midi_track_step(track); // Keep decoding until the note's length is known
+        } else {
+            u64 first_t = stream->keys[first] >> 1;
+            PidiCmd cmd = track->cmds.data[stream->heads[first]++];
+            cmd.dt = first_t - stream->cur_time;
+            stream->cur_time = first_t;
+            stream->song_len = AIL_MAX(stream->song_len, first_t + cmd.len*LEN_FACTOR);
+            out[n++] = cmd;
+
+            // Remove emitted cmds from the track, so that memory usage stays bounded by the amount of not-yet-emitted cmds
+            u32 head = stream->heads[first];
+            if (head >= MIDI_STREAM_COMPACT_MIN && 2*head >= track->cmds.len) {
+                memmove(track->cmds.data,   &track->cmds.data[head],   (track->cmds.len - head)*sizeof(PidiCmd));
+                memmove(track->starts.data, &track->starts.data[head], (track->starts.len - head)*sizeof(u64));
+                track->cmds.len   -= head;
+                track->starts.len -= head;
+                for (u32 k = 0; k < MIDI_NOTES_AMOUNT; k++) {
+                    if (track->open_notes[k].open) track->open_notes[k].idx -= head;
                 }
+                stream->heads[first] = 0;
             }
         }
-        ail_da_push(&pidi_chunks, pidi_chunk);
-        ail_da_push(&start_times, 0);
+        stream->keys[first] = midi_stream_key(stream, first);
+        if (stream->keys[first] == UINT64_MAX) stream->heap[0] = stream->heap[--stream->heap_len];
+        merge_heap_sift_down(stream->heap, stream->heap_len, 0, stream->keys);
     }
+    return n;
+}
 
-    return merge_sorted_chunks(pidi_chunks, start_times.data);
+void midi_stream_close(MidiStream *stream)
+{
+    for (u32 i = 0; i < stream->tracks.len; i++) {
+        ail_da_free(&stream->tracks.data[i].cmds);
+        ail_da_free(&stream->tracks.data[i].starts);
+    }
+    ail_da_free(&stream->tracks);
+    ail_da_free(&stream->tempo_map.segs);
+    free(stream->heads);
+    free(stream->keys);
+    free(stream->heap);
+    memset(stream, 0, sizeof(*stream));
 }
 
+// Sorts cmds by time with a stable LSD radix sort, so that on/off events at the same time keep their order
+// tmp needs to have space for len elements
+// Passes, in which all times have the same byte, are skipped, which is common for the higher bytes
+void sort_timed_cmds(PidiCmdTimed *cmds, PidiCmdTimed *tmp, u32 len)
+{
+    PidiCmdTimed *src = cmds;
+    PidiCmdTimed *dst = tmp;
+    for (u32 shift = 0; len && shift < 32; shift += 8) {
+        u32 offsets[256] = {0};
+        for (u32 i = 0; i < len; i++) offsets[(src[i].time >> shift) & 0xff]++;
+        if (offsets[(src[0].time >> shift) & 0xff] == len) continue;
+        for (u32 b = 0, sum = 0; b < 256; b++) {
+            u32 count  = offsets[b];
+            offsets[b] = sum;
+            sum       += count;
+        }
+        for (u32 i = 0; i < len; i++) dst[offsets[(src[i].time >> shift) & 0xff]++] = src[i];
+        AIL_SWAP_PORTABLE(PidiCmdTimed *, src, dst);
+    }
+    if (src != cmds) memcpy(cmds, src, len*sizeof(PidiCmdTimed));
+}
+
+// Set MIDI_PRINT_WRITTEN_EVENTS to print every event that is written
 void write_midi(Song song, const char *fpath)
 {
     AIL_DA(PidiCmdTimed) cmds = ail_da_new_with_cap(PidiCmdTimed, song.cmds.len*2);
@@ -337,26 +873,25 @@ void write_midi(Song song, const char *fpath)
         ail_da_push(&cmds, off);
     }
 
-    // Sort cmds
-    for (u32 i = 0; i < cmds.len-1; i++) {
-        u32 min = i;
-        for (u32 j = i+1; j < cmds.len; j++) {
-            if (cmds.data[j].time < cmds.data[min].time) min = j;
-        }
-        AIL_SWAP_PORTABLE(PidiCmdTimed, cmds.data[min], cmds.data[i]);
-    }
+    PidiCmdTimed *tmp = malloc(cmds.len*sizeof(PidiCmdTimed));
+    sort_timed_cmds(cmds.data, tmp, cmds.len);
+    free(tmp);
+#ifdef MIDI_PRINT_WRITTEN_EVENTS
     for (u32 i = 0; i < cmds.len; i++) {
         printf("time: %4dms, ", cmds.data[i].time);
         print_cmd(cmds.data[i].cmd);
     }
+#endif
 
     write_timed_midi(cmds.data, cmds.len, fpath);
+    ail_da_free(&cmds);
 }
 
 void write_timed_midi(const PidiCmdTimed *cmds, u32 len, const char *fpath)
 {
     // DBG_LOG("Writing %s back to midi in %s\n", song.name, fpath);
-    AIL_Buffer buffer = ail_buf_new(2048);
+    // The buffer is allocated with enough space for all events, so it never needs to grow
+    AIL_Buffer buffer = ail_buf_new(MIDI_WRITE_HEADER_MAX_SIZE + len*MIDI_WRITE_EVENT_MAX_SIZE);
     u16 ticksPQN = 480;
     u32 tempo = 705882; // 500000;
     ail_buf_write1(&buffer, 'M');
@@ -410,7 +945,7 @@ void write_timed_midi(const PidiCmdTimed *cmds, u32 len, const char *fpath)
     u32 last_tick = 0;
     for (u32 i = 0; i < len; i++) {
         PidiCmdTimed c = cmds[i];
-        u32 cur_tick   = c.time / (u64)(((f32)tempo / (f32)ticksPQN) / 1000.0f);
+        u32 cur_tick   = ((u64)c.time*1000*ticksPQN + tempo/2) / tempo; // +tempo/2 to do rounding
         u32 delta_time = cur_tick - last_tick;
         last_tick      = cur_tick;
 
@@ -58,11 +58,18 @@ int main(int argc, char *argv[])
 	}
 	char *input  = argv[1];
 	char *outdir = argc>=3 ? argv[2] : NULL;
-	AIL_Buffer buf = ail_buf_from_file(input);
-	ParseMidiRes res = parse_midi(buf);
+	FMap fmap;
+	if (!fmap_open(input, &fmap)) {
+		printf("Error: Could not open '%s'\n", input);
+		return 1;
+	}
+	ParseMidiRes res = parse_midi(fmap_to_buf(fmap), &ail_default_allocator);
+	fmap_close(&fmap);
 	if (!res.succ) {
 		printf("Error: %s\n", res.val.err);
 	} else {
+		// The scratch memory and the song are both alive while merging
+		printf("Memory: peak %llu bytes, steady-state %llu bytes\n", (unsigned long long)(res.stats.scratch + res.stats.song), (unsigned long long)res.stats.song);
 		if (outdir) {
 			char *songname = fname(input);
 			res.val.song.name = songname;
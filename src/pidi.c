@@ -0,0 +1,588 @@
+// Reading and writing of .pidi files
+//
+// Layout of a .pidi file (all integers are little-endian, except for the magic):
+//   u32           PIDI_MAGIC
+//   u32           PIDI_VERSION_FLAG | version
+//   u32           stride (sizeof(PidiCmd) of the program that wrote the file)
+//   u32           amount of commands
+//   u32           amount of blocks in the index
+//   u32           amount of held keys in the index
+//   PidiCmd[]     commands in their in-memory layout
+//   PidiBlock[]   index of the commands (aligned to PIDI_INDEX_ALIGN)
+//   PidiHeldKey[] keys held at the start of each block
+// Since everything is stored exactly as in memory, a mapped file can be used without decoding it first
+//
+// Compressed files (PIDI_COMPRESSED_FLAG set in the version) store no index and instead of the commands
+// the output of pidi_compress_cmds, which reaches until the end of the file
+// They are smaller on disk, but need to be decoded and indexed when loaded
+//
+// Version 2 files have neither the index nor its sizes in the header - their index is built when loading them
+// Files without a version (version 1) store the amount of commands right after the magic,
+// followed by the commands as encoded with encode_cmd. These files are still decoded when loaded
+#ifndef PIDI_C_
+#define PIDI_C_
+
+#include "ail.h"
+#include "ail_buf.h"
+#include "common.h"
+#include "fmap.c"
+
+#define PIDI_VERSION        3
+#define PIDI_VERSION_FLAG   0x80000000 // Distinguishes the version from the amount of commands in version 1 files
+#define PIDI_HEADER_SIZE    24         // Keeps the commands aligned in a mapped file
+#define PIDI_V2_HEADER_SIZE 16
+#define PIDI_INDEX_ALIGN    8
+#define PIDI_DECODE_BATCH   8          // Amount of commands decoded per iteration of pidi_decode_cmds
+#define PIDI_COMPRESSED_FLAG 0x40000000
+
+#define PIDI_PLANES          5  // Bytes per command in the compressed format (before the LZ stage)
+#define PIDI_LZ_MIN_MATCH    4
+#define PIDI_LZ_MAX_OFFSET   0xFFFF
+#define PIDI_LZ_HASH_BITS    14
+#define PIDI_LZ_LAST_LITERALS 12 // Amount of bytes at the end, that are always stored as literals
+#define PIDI_LZ_SLACK        16 // Amount of bytes after the decompressed data, that pidi_lz_decompress might overwrite
+
+// Define PIDI_COMPRESS to write compressed files by default
+#ifdef PIDI_COMPRESS
+#define PIDI_COMPRESS_DEFAULT true
+#else
+#define PIDI_COMPRESS_DEFAULT false
+#endif
+
+// A key, that is still held at the start of a block
+typedef struct PidiHeldKey {
+    u32 end; // Absolute time at which the key is released
+    u8  key;
+    i8  octave;
+    u8  velocity;
+    u8  _pad;
+} PidiHeldKey;
+AIL_DA_INIT(PidiHeldKey);
+
+// Block i of the index starts with the command at index i*CMDS_LIST_LEN
+// The keys held at its start are keys[keys_idx] up to the keys_idx of the next block (or the end of keys for the last block)
+typedef struct PidiBlock {
+    u32 start;    // Absolute time of the block's first command
+    u32 keys_idx;
+} PidiBlock;
+AIL_DA_INIT(PidiBlock);
+AIL_DA_INIT(MsgPidiPlayedKey);
+
+// Index for seeking in a list of commands without scanning it from the start
+// @Note: The index is always extended together with the list of commands it belongs to
+typedef struct PidiIndex {
+    AIL_DA(PidiBlock)   blocks;
+    AIL_DA(PidiHeldKey) keys;
+    AIL_DA(PidiHeldKey) held; // Keys held after the last indexed command - only needed for extending the index
+    u32 len;                  // Amount of indexed commands
+    u32 time;                 // Absolute time of the last indexed command
+} PidiIndex;
+
+// The mapping of a file, that a list of commands points into
+// The allocator needs to be the first member, since lists only hold a pointer to their allocator
+typedef struct PidiMapping {
+    AIL_Allocator allocator;
+    FMap          map;
+} PidiMapping;
+
+void pidi_decode_cmds(u8 *data, PidiCmd *out, u32 n);
+AIL_Buffer pidi_encode(const PidiCmd *cmds, u32 n, bool compress);
+u64 pidi_compress_cmds(const PidiCmd *cmds, u32 n, u8 *out);
+bool pidi_decompress_cmds(const u8 *data, u64 len, PidiCmd *out, u32 n);
+bool pidi_load(const char *fpath, AIL_DA(PidiCmd) *cmds, PidiIndex *index);
+PidiIndex pidi_index_new(void);
+void pidi_index_extend(PidiIndex *index, const PidiCmd *cmds, u32 len);
+u32 pidi_index_seek(const PidiIndex *index, const PidiCmd *cmds, u32 len, u32 time, AIL_DA(MsgPidiPlayedKey) *played_keys);
+void pidi_index_free(PidiIndex *index);
+
+// Decodes n commands, that were written with encode_cmd directly after each other, from data into out
+// data needs to contain at least n*ENCODED_CMD_LEN bytes
+// Unlike calling decode_cmd n times, no buffer cursor is read, bounds-checked and updated per command,
+// and PIDI_DECODE_BATCH independent commands are decoded per iteration, so that the compiler can interleave them
+void pidi_decode_cmds(u8 *data, PidiCmd *out, u32 n)
+{
+    u32 i = 0;
+    for (; i + PIDI_DECODE_BATCH <= n; i += PIDI_DECODE_BATCH) {
+        u8      *src = &data[(u64)i*ENCODED_CMD_LEN];
+        PidiCmd *dst = &out[i];
+        for (u32 j = 0; j < PIDI_DECODE_BATCH; j++) dst[j] = decode_cmd_simple(&src[j*ENCODED_CMD_LEN]);
+    }
+    for (; i < n; i++) out[i] = decode_cmd_simple(&data[(u64)i*ENCODED_CMD_LEN]);
+}
+
+PidiIndex pidi_index_new(void)
+{
+    return (PidiIndex) {
+        .blocks = ail_da_new(PidiBlock),
+        .keys   = ail_da_new(PidiHeldKey),
+        .held   = ail_da_new_with_cap(PidiHeldKey, KEYS_AMOUNT),
+        .len    = 0,
+        .time   = 0,
+    };
+}
+
+// Indexes the commands from index->len up to len
+// cmds needs to be the same list, that the index was extended with before
+void pidi_index_extend(PidiIndex *index, const PidiCmd *cmds, u32 len)
+{
+    for (u32 i = index->len; i < len; i++) {
+        PidiCmd cmd = cmds[i];
+        u32 time    = index->time + cmd.dt;
+        if (i % CMDS_LIST_LEN == 0) {
+            // Released keys are only removed at the start of a block, which keeps held small enough
+            u32 n = 0;
+            for (u32 j = 0; j < index->held.len; j++) {
+                if (index->held.data[j].end > time) index->held.data[n++] = index->held.data[j];
+            }
+            index->held.len = n;
+            PidiBlock block = { .start = time, .keys_idx = index->keys.len };
+            ail_da_push(&index->blocks, block);
+            if (n) ail_da_pushn(&index->keys, index->held.data, n);
+        }
+        if (cmd.len) {
+            PidiHeldKey hk = {
+                .end      = time + cmd.len*LEN_FACTOR,
+                .key      = cmd.key,
+                .octave   = cmd.octave,
+                .velocity = cmd.velocity,
+            };
+            ail_da_push(&index->held, hk);
+        }
+        index->time = time;
+    }
+    index->len = AIL_MAX(index->len, len);
+}
+
+// Returns the index of the first command, that starts at or after time,
+// and pushes all keys, that are still held at time, to played_keys
+// Only the block containing time needs to be scanned, which keeps seeking in long songs fast
+u32 pidi_index_seek(const PidiIndex *index, const PidiCmd *cmds, u32 len, u32 time, AIL_DA(MsgPidiPlayedKey) *played_keys)
+{
+    AIL_ASSERT(index->len >= len);
+    if (!index->blocks.len) return 0;
+    // Find the last block starting before time (or the first block if there is none)
+    u32 lo = 0, hi = index->blocks.len;
+    while (hi - lo > 1) {
+        u32 mid = lo + (hi - lo)/2;
+        if (index->blocks.data[mid].start < time) lo = mid;
+        else hi = mid;
+    }
+    PidiBlock block   = index->blocks.data[lo];
+    u32       keys_to = lo + 1 < index->blocks.len ? index->blocks.data[lo + 1].keys_idx : index->keys.len;
+    for (u32 j = block.keys_idx; j < keys_to; j++) {
+        PidiHeldKey hk = index->keys.data[j];
+        if (time < hk.end) {
+            MsgPidiPlayedKey pk = {
+                .key      = hk.key,
+                .octave   = hk.octave,
+                .len      = (hk.end - time)/LEN_FACTOR,
+                .velocity = hk.velocity,
+            };
+            ail_da_push(played_keys, pk);
+        }
+    }
+    u32 i         = lo*CMDS_LIST_LEN;
+    u32 cmd_start = block.start;
+    if (i < len) cmd_start -= cmds[i].dt; // Time of the command before, so the loop can add the dt of each command
+    for (; i < len && cmd_start + cmds[i].dt < time; i++) {
+        PidiCmd cmd = cmds[i];
+        cmd_start  += cmd.dt;
+        u32 end_time = cmd_start + cmd.len*LEN_FACTOR;
+        if (time < end_time) {
+            MsgPidiPlayedKey pk = {
+                .key      = cmd.key,
+                .octave   = cmd.octave,
+                .len      = (end_time - time)/LEN_FACTOR,
+                .velocity = cmd.velocity,
+            };
+            ail_da_push(played_keys, pk);
+        }
+    }
+    return i;
+}
+
+void pidi_index_free(PidiIndex *index)
+{
+    ail_da_free(&index->blocks);
+    ail_da_free(&index->keys);
+    if (index->held.data) ail_da_free(&index->held);
+    *index = (PidiIndex){0};
+}
+
+static inline u64 pidi_index_offset(u32 n)
+{
+    u64 offset = PIDI_HEADER_SIZE + (u64)n*sizeof(PidiCmd);
+    return (offset + PIDI_INDEX_ALIGN - 1) & ~(u64)(PIDI_INDEX_ALIGN - 1);
+}
+
+// Checks that the held keys of each block of a stored index lie within its nkeys keys,
+// so that a corrupt or partially written file is indexed again instead of being read past its end
+static bool pidi_index_valid(const PidiBlock *blocks, u32 nblocks, u32 nkeys)
+{
+    u32 prev = 0;
+    for (u32 i = 0; i < nblocks; i++) {
+        if (blocks[i].keys_idx < prev || blocks[i].keys_idx > nkeys) return false;
+        prev = blocks[i].keys_idx;
+    }
+    return true;
+}
+
+// Upper bound for the output size of pidi_lz_compress
+static inline u64 pidi_lz_bound(u64 len)
+{
+    return len + len/255 + 16;
+}
+
+// Upper bound for the output size of pidi_lz_decompress
+// No byte of a sequence produces more than 255 bytes of output (a token at most 15 + PIDI_LZ_MIN_MATCH, a length byte at most 255)
+static inline u64 pidi_lz_max_expansion(u64 in_len)
+{
+    return in_len*255;
+}
+
+static inline u32 pidi_read32(const u8 *p)
+{
+    u32 x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static inline u8 *pidi_lz_write_len(u8 *out, u64 len)
+{
+    for (; len >= 255; len -= 255) *out++ = 255;
+    *out++ = (u8)len;
+    return out;
+}
+
+// Writes a sequence of literals followed by a match (unless mlen is 0, which marks the last sequence)
+static inline u8 *pidi_lz_write_seq(u8 *out, const u8 *lits, u64 nlits, u32 offset, u64 mlen)
+{
+    u8 *token = out++;
+    u64 mcode = mlen ? mlen - PIDI_LZ_MIN_MATCH : 0;
+    *token = (u8)(AIL_MIN(nlits, 15) << 4 | AIL_MIN(mcode, 15));
+    if (nlits >= 15) out = pidi_lz_write_len(out, nlits - 15);
+    memcpy(out, lits, nlits);
+    out += nlits;
+    if (mlen) {
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        if (mcode >= 15) out = pidi_lz_write_len(out, mcode - 15);
+    }
+    return out;
+}
+
+// Compresses in into out with a byte-oriented LZ77 in the style of LZ4
+// Each sequence is a token (4 bits literal length, 4 bits match length), the literals, a 2 byte offset and the match
+// Lengths of 15 and more are continued in following bytes, the last sequence has no match
+// out needs space for pidi_lz_bound(len) bytes
+static u64 pidi_lz_compress(const u8 *in, u64 len, u8 *out)
+{
+    u32 *table = calloc(1 << PIDI_LZ_HASH_BITS, sizeof(u32));
+    u8  *o     = out;
+    u64 anchor = 0;
+    u64 limit  = len > PIDI_LZ_LAST_LITERALS ? len - PIDI_LZ_LAST_LITERALS : 0;
+    for (u64 i = 0; i < limit;) {
+        u32 seq  = pidi_read32(&in[i]);
+        u32 h    = (seq*2654435761u) >> (32 - PIDI_LZ_HASH_BITS);
+        u64 cand = table[h];
+        table[h] = (u32)i;
+        if (cand < i && i - cand <= PIDI_LZ_MAX_OFFSET && pidi_read32(&in[cand]) == seq) {
+            u64 m = i + PIDI_LZ_MIN_MATCH;
+            while (m < limit && in[m] == in[m - (i - cand)]) m++;
+            o = pidi_lz_write_seq(o, &in[anchor], i - anchor, (u32)(i - cand), m - i);
+            i = anchor = m;
+        } else {
+            i++;
+        }
+    }
+    o = pidi_lz_write_seq(o, &in[anchor], len - anchor, 0, 0);
+    free(table);
+    return o - out;
+}
+
+// Reads a length continued in the following bytes, returns false if the input ends first
+static inline bool pidi_lz_read_len(const u8 **ip, const u8 *iend, u64 *len)
+{
+    u8 b;
+    do {
+        if (*ip >= iend) return false;
+        b     = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses the output of pidi_lz_compress
+// out needs space for out_len + PIDI_LZ_SLACK bytes, since short copies are done in fixed-size chunks
+// Returns false if the input is corrupt or doesn't decompress to exactly out_len bytes
+static bool pidi_lz_decompress(const u8 *in, u64 in_len, u8 *out, u64 out_len)
+{
+    const u8 *ip   = in;
+    const u8 *iend = in + in_len;
+    u8       *op   = out;
+    u8       *oend = out + out_len;
+    while (ip < iend) {
+        u8  token = *ip++;
+        u64 nlits = token >> 4;
+        if (nlits == 15 && !pidi_lz_read_len(&ip, iend, &nlits)) return false;
+        if (nlits > (u64)(iend - ip) || nlits > (u64)(oend - op)) return false;
+        if (nlits <= 16 && iend - ip >= 16) memcpy(op, ip, 16);
+        else memcpy(op, ip, nlits);
+        ip += nlits;
+        op += nlits;
+        if (ip == iend) break; // The last sequence has no match
+
+        if (iend - ip < 2) return false;
+        u32 offset = ip[0] | (u32)ip[1] << 8;
+        ip += 2;
+        u64 mlen = token & 15;
+        if (mlen == 15 && !pidi_lz_read_len(&ip, iend, &mlen)) return false;
+        mlen += PIDI_LZ_MIN_MATCH;
+        if (!offset || offset > (u64)(op - out) || mlen > (u64)(oend - op)) return false;
+        const u8 *match = op - offset;
+        if (offset >= 16 && mlen <= 16) {
+            memcpy(op, match, 16);
+        } else if (offset >= 8) {
+            for (u64 k = 0; k < mlen; k += 8) memcpy(&op[k], &match[k], 8);
+        } else {
+            // The match repeats the last offset bytes, so after expanding the pattern to a multiple of offset,
+            // that is at least 8, it can also be copied in chunks (i.e. runs of zeros in the planes)
+            u64 dist = offset*((8 + offset - 1)/offset);
+            u64 k    = 0;
+            for (; k < AIL_MIN(dist, mlen); k++) op[k] = match[k];
+            for (; k < mlen; k += 8) memcpy(&op[k], &op[k - dist], 8);
+        }
+        op += mlen;
+    }
+    return op == oend;
+}
+
+// Compresses the commands into out, which needs space for pidi_lz_bound(n*PIDI_PLANES) bytes
+// Each field of the commands is first written into its own plane, so that the LZ stage finds the repetitions in each of them
+// The pitch is stored as zigzag-encoded difference to the previous command, so that chords and melodies in different octaves look the same
+// Unlike the uncompressed format, this doesn't depend on the layout of PidiCmd
+u64 pidi_compress_cmds(const PidiCmd *cmds, u32 n, u8 *out)
+{
+    u8 *planes = malloc((u64)n*PIDI_PLANES);
+    u8 prev_pitch = 0;
+    for (u32 i = 0; i < n; i++) {
+        PidiCmd cmd = cmds[i];
+        AIL_ASSERT(cmd.key < PIANO_KEY_AMOUNT);
+        u8 pitch = (u8)(cmd.octave*PIANO_KEY_AMOUNT + cmd.key);
+        i8 delta = (i8)(u8)(pitch - prev_pitch);
+        planes[0*(u64)n + i] = cmd.dt & 0xFF;
+        planes[1*(u64)n + i] = cmd.dt >> 8;
+        planes[2*(u64)n + i] = cmd.len;
+        planes[3*(u64)n + i] = (u8)((u8)delta << 1) ^ (u8)(delta >> 7);
+        planes[4*(u64)n + i] = cmd.velocity;
+        prev_pitch = pitch;
+    }
+    u64 len = pidi_lz_compress(planes, (u64)n*PIDI_PLANES, out);
+    free(planes);
+    return len;
+}
+
+// Decompresses n commands, that were compressed with pidi_compress_cmds, from data into out
+// Returns false if data is corrupt
+bool pidi_decompress_cmds(const u8 *data, u64 len, PidiCmd *out, u32 n)
+{
+    u64 planes_len = (u64)n*PIDI_PLANES;
+    u8 *planes     = malloc(planes_len + PIDI_LZ_SLACK);
+    bool succ      = pidi_lz_decompress(data, len, planes, planes_len);
+    if (succ) {
+        const u8 *dt_lo = &planes[0*(u64)n], *dt_hi = &planes[1*(u64)n], *lens = &planes[2*(u64)n];
+        const u8 *pitch_deltas = &planes[3*(u64)n], *velocities = &planes[4*(u64)n];
+        u8 pitch = 0;
+        for (u32 i = 0; i < n; i++) {
+            u8 z   = pitch_deltas[i];
+            pitch += (u8)(z >> 1) ^ (u8)-(z & 1);
+            // Pitches range from -8 octaves, so they are shifted to be positive before dividing
+            i32 shifted = (i32)(i8)pitch + 8*PIANO_KEY_AMOUNT;
+            out[i] = (PidiCmd) {
+                .dt       = dt_lo[i] | (u16)dt_hi[i] << 8,
+                .len      = lens[i],
+                .velocity = velocities[i],
+                .octave   = shifted/PIANO_KEY_AMOUNT - 8,
+                .key      = shifted%PIANO_KEY_AMOUNT,
+            };
+        }
+    }
+    free(planes);
+    return succ;
+}
+
+// Writes the commands and their index into a buffer in the layout of the current PIDI_VERSION
+// If compress is true, the commands are compressed and the index is left out instead
+AIL_Buffer pidi_encode(const PidiCmd *cmds, u32 n, bool compress)
+{
+    if (compress) {
+        AIL_Buffer buf = ail_buf_new(PIDI_HEADER_SIZE + pidi_lz_bound((u64)n*PIDI_PLANES));
+        ail_buf_write4msb(&buf, PIDI_MAGIC);
+        ail_buf_write4lsb(&buf, PIDI_VERSION_FLAG | PIDI_COMPRESSED_FLAG | PIDI_VERSION);
+        ail_buf_write4lsb(&buf, sizeof(PidiCmd));
+        ail_buf_write4lsb(&buf, n);
+        ail_buf_write4lsb(&buf, 0);
+        ail_buf_write4lsb(&buf, 0);
+        buf.idx += pidi_compress_cmds(cmds, n, &buf.data[buf.idx]);
+        buf.len  = buf.idx;
+        return buf;
+    }
+    PidiIndex index = pidi_index_new();
+    pidi_index_extend(&index, cmds, n);
+    u64 index_offset = pidi_index_offset(n);
+    AIL_Buffer buf   = ail_buf_new(index_offset + (u64)index.blocks.len*sizeof(PidiBlock) + (u64)index.keys.len*sizeof(PidiHeldKey));
+    ail_buf_write4msb(&buf, PIDI_MAGIC);
+    ail_buf_write4lsb(&buf, PIDI_VERSION_FLAG | PIDI_VERSION);
+    ail_buf_write4lsb(&buf, sizeof(PidiCmd));
+    ail_buf_write4lsb(&buf, n);
+    ail_buf_write4lsb(&buf, index.blocks.len);
+    ail_buf_write4lsb(&buf, index.keys.len);
+    ail_buf_writestr(&buf, (const char *)cmds, (u64)n*sizeof(PidiCmd));
+    while (buf.idx < index_offset) ail_buf_write1(&buf, 0);
+    ail_buf_writestr(&buf, (const char *)index.blocks.data, (u64)index.blocks.len*sizeof(PidiBlock));
+    ail_buf_writestr(&buf, (const char *)index.keys.data,   (u64)index.keys.len*sizeof(PidiHeldKey));
+    pidi_index_free(&index);
+    return buf;
+}
+
+// Lists pointing into a mapping can't grow, as the mapping is read-only
+static void *pidi_mapping_alloc(void *data, u64 size)
+{
+    AIL_UNUSED(data);
+    AIL_UNUSED(size);
+    AIL_UNREACHABLE();
+    return NULL;
+}
+
+static void *pidi_mapping_zero_alloc(void *data, u64 nelem, u64 size_el)
+{
+    AIL_UNUSED(nelem);
+    return pidi_mapping_alloc(data, size_el);
+}
+
+static void *pidi_mapping_re_alloc(void *data, void *ptr, u64 size)
+{
+    AIL_UNUSED(ptr);
+    return pidi_mapping_alloc(data, size);
+}
+
+// Freeing the list unmaps the file
+static void pidi_mapping_free_one(void *data, void *ptr)
+{
+    AIL_UNUSED(ptr);
+    PidiMapping *mapping = data;
+    fmap_close(&mapping->map);
+    free(mapping);
+}
+
+static void pidi_mapping_free_all(void *data)
+{
+    pidi_mapping_free_one(data, NULL);
+}
+
+// The index of a mapped file lives in the same mapping as its commands, which is unmapped when the commands are freed
+static void pidi_view_free_one(void *data, void *ptr)
+{
+    AIL_UNUSED(data);
+    AIL_UNUSED(ptr);
+}
+
+static void pidi_view_free_all(void *data)
+{
+    AIL_UNUSED(data);
+}
+
+static AIL_Allocator pidi_view_allocator = {
+    .data       = NULL,
+    .alloc      = pidi_mapping_alloc,
+    .zero_alloc = pidi_mapping_zero_alloc,
+    .re_alloc   = pidi_mapping_re_alloc,
+    .free_one   = pidi_view_free_one,
+    .free_all   = pidi_view_free_all,
+};
+
+// Loads the commands of the .pidi file at fpath into cmds and their index into index
+// For files of the current version, cmds and index point directly into the mapped file and the file is unmapped once cmds is freed,
+// so opening a song only costs the page faults for the parts that are actually read
+// The index has to be freed before cmds and can't be extended
+// Compressed and older files are decoded and indexed into newly allocated lists instead
+// Returns false if the file couldn't be opened or is not a valid .pidi file
+bool pidi_load(const char *fpath, AIL_DA(PidiCmd) *cmds, PidiIndex *index)
+{
+    FMap map;
+    if (!fmap_open(fpath, &map)) return false;
+    AIL_Buffer buf = fmap_to_buf(map);
+    if (buf.len < 8 || ail_buf_read4msb(&buf) != PIDI_MAGIC) goto failed;
+    u32 version = ail_buf_read4lsb(&buf);
+    if (version & PIDI_VERSION_FLAG) {
+        bool compressed = version & PIDI_COMPRESSED_FLAG;
+        version &= ~(PIDI_VERSION_FLAG | PIDI_COMPRESSED_FLAG);
+        u32 header_size = version == 2 ? PIDI_V2_HEADER_SIZE : PIDI_HEADER_SIZE;
+        if ((version != 2 && version != PIDI_VERSION) || buf.len < header_size) goto failed;
+        u32 stride = ail_buf_read4lsb(&buf);
+        u32 n      = ail_buf_read4lsb(&buf);
+        u32 nblocks = 0, nkeys = 0;
+        if (version == PIDI_VERSION) {
+            nblocks = ail_buf_read4lsb(&buf);
+            nkeys   = ail_buf_read4lsb(&buf);
+        }
+        if (compressed) {
+            // The amount of commands is checked against the size of the file, so that a corrupt header can't cause huge allocations
+            if (version != PIDI_VERSION || (u64)n*PIDI_PLANES > pidi_lz_max_expansion(buf.len - buf.idx)) goto failed;
+            *cmds     = ail_da_new_with_cap(PidiCmd, AIL_MAX(n, 1));
+            cmds->len = n;
+            bool decompressed = pidi_decompress_cmds(&buf.data[buf.idx], buf.len - buf.idx, cmds->data, n);
+            fmap_close(&map);
+            if (!decompressed) {
+                ail_da_free(cmds);
+                return false;
+            }
+            goto build_index;
+        }
+        u64 index_offset = pidi_index_offset(n);
+        u64 size         = version == PIDI_VERSION ? index_offset + (u64)nblocks*sizeof(PidiBlock) + (u64)nkeys*sizeof(PidiHeldKey) : buf.idx + (u64)n*sizeof(PidiCmd);
+        // A different stride means, that the file was written by a program with a different layout of PidiCmd
+        if (stride != sizeof(PidiCmd) || size > buf.len) goto failed;
+        // The index is only usable, if it was built with the same CMDS_LIST_LEN and is intact
+        bool indexed = version == PIDI_VERSION && nblocks == (n + CMDS_LIST_LEN - 1)/CMDS_LIST_LEN &&
+                       pidi_index_valid((const PidiBlock *)&map.data[index_offset], nblocks, nkeys);
+        PidiMapping *mapping = malloc(sizeof(PidiMapping));
+        mapping->allocator = (AIL_Allocator) {
+            .data       = mapping,
+            .alloc      = pidi_mapping_alloc,
+            .zero_alloc = pidi_mapping_zero_alloc,
+            .re_alloc   = pidi_mapping_re_alloc,
+            .free_one   = pidi_mapping_free_one,
+            .free_all   = pidi_mapping_free_all,
+        };
+        mapping->map = map;
+        *cmds = ail_da_from_parts(PidiCmd, (PidiCmd *)&map.data[buf.idx], n, n, &mapping->allocator);
+        if (indexed) {
+            *index = (PidiIndex) {
+                .blocks = ail_da_from_parts(PidiBlock,   (PidiBlock *)&map.data[index_offset], nblocks, nblocks, &pidi_view_allocator),
+                .keys   = ail_da_from_parts(PidiHeldKey, (PidiHeldKey *)&map.data[index_offset + (u64)nblocks*sizeof(PidiBlock)], nkeys, nkeys, &pidi_view_allocator),
+                .held   = { 0 },
+                .len    = n,
+                .time   = 0,
+            };
+            return true;
+        }
+    } else {
+        u32 n = version;
+        if (buf.idx + (u64)n*ENCODED_CMD_LEN > buf.len) goto failed;
+        *cmds     = ail_da_new_with_cap(PidiCmd, AIL_MAX(n, 1));
+        cmds->len = n;
+        pidi_decode_cmds(&buf.data[buf.idx], cmds->data, n);
+        fmap_close(&map);
+    }
+build_index:
+    *index = pidi_index_new();
+    pidi_index_extend(index, cmds->data, cmds->len);
+    return true;
+
+failed:
+    fmap_close(&map);
+    return false;
+}
+
+#endif // PIDI_C_
@@ -16,8 +16,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	const char *input = argv[1];
-	AIL_Buffer buf = ail_buf_from_file(input);
-	ParseMidiRes res = parse_midi(buf);
+	FMap fmap;
+	if (!fmap_open(input, &fmap)) {
+		printf("Error: Could not open '%s'\n", input);
+		return 1;
+	}
+	ParseMidiRes res = parse_midi(fmap_to_buf(fmap), &ail_default_allocator);
+	fmap_close(&fmap);
 	if (!res.succ) {
 		printf("Error: %s\n", res.val.err);
 	} else {
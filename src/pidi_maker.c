@@ -11,6 +11,8 @@
 #include "ail_alloc.h"
 #include "common.h"
 #include "midi.c"
+#include "pidi.c"
+#include "library.c"
 #include <stdio.h>
 #include <windows.h>
 #include <conio.h>
@@ -35,12 +37,7 @@ void clearScreen()
 
 bool save_pidi(Song song, AIL_SV data_dir_path)
 {
-    AIL_Buffer buf = ail_buf_new(1024);
-    ail_buf_write4msb(&buf, PIDI_MAGIC);
-    ail_buf_write4lsb(&buf, song.cmds.len);
-    for (u32 i = 0; i < song.cmds.len; i++) {
-        encode_cmd(&buf, song.cmds.data[i]);
-    }
+    AIL_Buffer buf = pidi_encode(song.cmds.data, song.cmds.len, PIDI_COMPRESS_DEFAULT);
 
     u64 data_dir_path_len = data_dir_path.len;
     u64 name_len          = strlen(song.name);
@@ -53,54 +50,6 @@ bool save_pidi(Song song, AIL_SV data_dir_path)
     return out;
 }
 
-bool save_library(AIL_DA(Song) library, AIL_SV data_dir_path, AIL_SV library_filepath)
-{
-    AIL_Buffer buf = ail_buf_new(1024);
-    ail_buf_write4msb(&buf, PDIL_MAGIC);
-    ail_buf_write4lsb(&buf, library.len);
-    for (u32 i = 0; i < library.len; i++) {
-        Song song = library.data[i];
-        u32 name_len  = strlen(song.name);
-        ail_buf_write4lsb(&buf, name_len);
-        ail_buf_write8lsb(&buf, song.len);
-        ail_buf_writestr(&buf, song.name, name_len);
-    }
-    if (!ail_fs_dir_exists(data_dir_path.str)) mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    return ail_buf_to_file(&buf, library_filepath.str);
-}
-
-AIL_DA(Song) load_library(AIL_SV data_dir_path, AIL_SV library_filepath)
-{
-	AIL_DA(Song) library = ail_da_new_empty(Song);
-    if (!ail_fs_dir_exists(data_dir_path.str)) {
-        mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-        goto nothing_to_load;
-    } else {
-        if (!ail_fs_is_file(library_filepath.str)) goto nothing_to_load;
-        AIL_Buffer buf = ail_buf_from_file(library_filepath.str);
-        if (ail_buf_read4msb(&buf) != PDIL_MAGIC) goto nothing_to_load;
-        u32 n = ail_buf_read4lsb(&buf);
-        ail_da_maybe_grow(&library, n);
-        for (; n > 0; n--) {
-            u32 name_len = ail_buf_read4lsb(&buf);
-            u64 song_len = ail_buf_read8lsb(&buf);
-            char *name   = ail_buf_readstr(&buf, name_len);
-            Song song = {
-                .name   = name,
-                .len    = song_len,
-                .cmds = ail_da_new_empty(PidiCmd),
-            };
-            ail_da_push(&library, song);
-        }
-        goto end;
-    }
-
-nothing_to_load:
-    ail_da_maybe_grow(&library, 16);
-end:
-    return library;
-}
-
 u64 get_song_len(AIL_DA(PidiCmd) cmds)
 {
 	u64 len = 0;
@@ -174,8 +123,9 @@ void from_piano_idx(u8 idx, PidiCmd *cmd)
 
 int main(void)
 {
-	AIL_SV data_dir_path    = ail_sv_from_cstr("./bin/data/");
-	AIL_SV library_filepath = ail_sv_from_cstr("./bin/data/library.pdil");
+	AIL_SV data_dir_path            = ail_sv_from_cstr("./bin/data/");
+	AIL_SV library_filepath         = ail_sv_from_cstr("./bin/data/library.pdil");
+	AIL_SV library_journal_filepath = ail_sv_from_cstr("./bin/data/library.pdij");
 	AIL_DA(PidiCmd) cmds = ail_da_new(PidiCmd);
 	// AIL_Allocator arena = ail_alloc_arena_new(AIL_ALLOC_PAGE_SIZE, &ail_alloc_pager);
 #define BUFFER_LEN 2048
@@ -295,9 +245,14 @@ get_fname:
 		printf("Failed to save PIDI file '%s' :(\n", song.name);
 		return 1;
 	}
-	AIL_DA(Song) songs = load_library(data_dir_path, library_filepath);
-	ail_da_push(&songs, song);
-	if (!save_library(songs, data_dir_path, library_filepath)) {
+	if (!ail_fs_dir_exists(data_dir_path.str)) mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	LibraryFiles library_files = {
+		.snapshot_path = library_filepath.str,
+		.journal_path  = library_journal_filepath.str,
+	};
+	AIL_DA(Song) songs = library_load(&library_files);
+	SongMeta meta = library_song_meta(song);
+	if (!library_add(&songs, song, &meta, &library_files)) {
 		printf("Failed to save Library file :(\n");
 		return 1;
 	}
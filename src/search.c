@@ -0,0 +1,774 @@
+// Searching the song library
+//
+// Prefix queries are answered by a radix trie over the case-folded names of all songs
+// Each node of the trie has a label, that points into the case-folded name of a song in the library's name arena,
+// so that building the trie doesn't copy any names
+// The children of a node are kept in a sibling list, that is sorted by the first byte of their labels,
+// which means that collecting the songs below a node in depth-first order returns them sorted by name
+// Since every inner node of a radix trie has at least two children or ends a name, the subtree of a prefix has O(matches) nodes
+// and a prefix query thus takes O(query length + matches)
+//
+// Substring queries are answered by a trigram index, that maps each trigram of the case-folded names to the sorted list of songs containing it
+// The lists of all trigrams of a query are intersected, which leaves few candidates, that are then checked for actually containing the query
+// Since building the index takes a while for big libraries, it is built in the background and only covers the songs,
+// that existed when it was built - songs imported afterwards and queries shorter than a trigram are checked one by one instead
+// Substring matches, whose name has a word starting with the query, are ranked first, followed by all other substring matches
+// and both are ranked by how early the query appears in their name and then by the length of their name
+// Since only a few results are visible at once, only the best SEARCH_RANK_TOP_K substring matches are ranked
+// and all others follow them in order of the library, which keeps short queries (matching most of the library) cheap
+// Checking whether a name contains the query is done 16 positions at a time with SSE2, by comparing the first and last byte of the query
+// at each position and only comparing the whole query where both match (this relies on the slack after the name arena's chunks)
+//
+// While typing, each query usually extends the previous one, so the results of every query are cached as a level in a SearchCache
+// A query extending the cached one only filters the hits of the last level, and removing characters only drops levels,
+// so the cost of typing shrinks with the amount of results instead of staying proportional to the library
+//
+// Songs that only contain the query with typos are found by search_fuzzy, which uses the bit-parallel Bitap algorithm
+// (with the extension by Wu and Manber for allowing up to k insertions, deletions or substitutions) on every name
+// Since a short query with typos matches a large part of the library, only the best SEARCH_FUZZY_TOP_K of them are kept in a bounded heap
+// Fuzzy matches are only searched for, if there are fewer than SEARCH_FUZZY_TOP_K exact ones, since they'd be listed after those anyway
+// and since unlike the exact searches, they need to check the whole library for every query
+//
+// The UI doesn't search itself, but hands each query to a search thread with search_request and picks up the results with search_poll
+// Every request gets a new generation, which is returned by search_poll together with its results, so the UI can tell which query produced them, and a search, whose generation is not the newest one anymore, is cancelled,
+// so that the search thread never finishes queries, that were already replaced by further typing
+// The results of a search are only published once it completed, by swapping them with the previously published ones
+// @Note: Only the search thread searches and only the UI thread requests and polls searches
+// Any thread changing the library, trie or trigram index needs to hold search_library_lock while doing so
+// @Note: The trie and trigram index store indexes into the library, so they need to be rebuilt after a song was deleted from the library
+#ifndef SEARCH_C_
+#define SEARCH_C_
+
+#include "ail.h"
+#include "common.h"
+#include "library.c"
+#include <pthread.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#define SEARCH_SSE2
+#include <emmintrin.h>
+#endif
+
+#define SEARCH_FUZZY_MAX_ERRORS 2
+#define SEARCH_FUZZY_MAX_LEN    64  // Queries need to fit into the bits of a u64 for Bitap
+#define SEARCH_FUZZY_TOP_K      128 // Maximum amount of fuzzy matches returned by search_fuzzy
+#define SEARCH_RANK_TOP_K       256 // Amount of substring matches, that are ranked
+#define SEARCH_CANCEL_INTERVAL  1024 // Amount of songs checked between checking whether a search was cancelled
+
+// Tiers in which search results are ranked
+typedef enum SearchTier {
+    SEARCH_TIER_PREFIX,
+    SEARCH_TIER_WORD_START,
+    SEARCH_TIER_SUBSTRING,
+    SEARCH_TIER_FUZZY, // SEARCH_TIER_FUZZY + k - 1 for matches with k errors
+} SearchTier;
+
+typedef struct SearchTrieNode {
+    const char *label;        // Points into the case-folded name of a song
+    u32         label_len;
+    u32         first_child;  // 0 if the node has no children (the root is node 0 and is never a child)
+    u32         next_sibling; // 0 if the node is the last child of its parent
+    u32         first_song;   // Index + 1 of the first song, whose name ends at this node, or 0 if there is none
+} SearchTrieNode;
+AIL_DA_INIT(SearchTrieNode);
+
+typedef struct SearchTrie {
+    AIL_DA(SearchTrieNode) nodes;
+    AIL_DA(u32)            next_song; // Index + 1 of the next song ending at the same node (names are only unique before case-folding)
+    AIL_DA(u32)            stack;     // Reused for collecting the results of a query
+} SearchTrie;
+
+typedef struct SearchTrigrams {
+    AIL_DA(u32) grams;   // Sorted trigrams, that appear in any name
+    AIL_DA(u32) offsets; // The songs containing grams.data[i] are songs.data[offsets.data[i]..offsets.data[i+1]]
+    AIL_DA(u32) songs;   // Indexes of songs in the library, sorted for each trigram
+    u32         indexed; // Amount of songs at the start of the library, that are covered by the index
+} SearchTrigrams;
+
+typedef struct SearchLevel {
+    u32 query_len;
+    u32 start;    // The hits of this level are hits.data[start..end]
+    u32 prefixed; // The first prefixed hits are songs starting with the query
+    u32 end;
+} SearchLevel;
+AIL_DA_INIT(SearchLevel);
+
+typedef struct SearchCache {
+    AIL_DA(char)        query;  // Case-folded query of the last level
+    AIL_DA(SearchLevel) levels;
+    AIL_DA(u32)         hits;   // Indexes of songs in the library for all levels
+} SearchCache;
+
+typedef struct SearchMatch {
+    u32 song;
+    u32 tier; // SearchTier
+    u32 pos;  // 0 for fuzzy matches
+    u32 len;
+} SearchMatch;
+AIL_DA_INIT(SearchMatch);
+
+// Everything the search thread searches in - each pointer is owned by the UI
+typedef struct SearchSources {
+    AIL_DA(Song)   *library;
+    SearchTrie     *trie;
+    SearchTrigrams *trigrams;
+    bool           *trigrams_ready; // The trigram index is only used once this is true
+} SearchSources;
+
+static AIL_DA(char)  search_query      = { 0 }; // Case-folded query of the newest request
+static volatile u32  search_generation = 0;     // Incremented by every request
+static u32           search_running    = 0;     // Generation of the search, that the search thread is working on
+static AIL_DA(u32)   search_done       = { 0 }; // Indexes of the songs found by the last completed search
+static u32           search_done_gen   = 0;
+static u32           search_polled_gen = 0;     // Generation of the results, that the UI received last
+static SearchCache   search_thread_cache;       // Only accessed by the search thread (and search_library_changed)
+
+static pthread_mutex_t search_mutex         = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t search_library_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  search_cond          = PTHREAD_COND_INITIALIZER;
+
+SearchTrie search_trie_build(AIL_DA(Song) library);
+void search_trie_insert(SearchTrie *trie, const char *name, u32 idx);
+void search_trie_prefixed(SearchTrie *trie, const char *folded, u32 len, AIL_DA(u32) *out);
+void search_trie_free(SearchTrie *trie);
+SearchTrigrams search_trigrams_build(char **names, u32 n);
+void search_substrings(SearchTrigrams *index, AIL_DA(Song) library, const char *folded, u32 len, AIL_DA(u32) *out);
+void search_trigrams_free(SearchTrigrams *index);
+SearchLevel search_cached(SearchCache *cache, SearchTrie *trie, SearchTrigrams *index, AIL_DA(Song) library, const char *folded, u32 len);
+void search_cache_clear(SearchCache *cache);
+void search_fuzzy(AIL_DA(Song) library, const char *folded, u32 len, AIL_DA(u32) *out);
+
+// For communicating with the search thread, the UI thread should call the following functions
+void *search_thread_main(void *_sources);
+u32  search_request(const char *query);
+u32  search_poll(AIL_DA(Song) library, AIL_DA(Song) *results);
+void search_library_lock(void);
+void search_library_unlock(void);
+void search_library_changed(void);
+
+// Internal only functions
+static u32 search_trie_new_node(SearchTrie *trie, const char *label, u32 label_len);
+static inline u32 search_trigram(const char *s);
+static i32 search_find_gram(SearchTrigrams *index, u32 gram);
+static i32 search_substr_pos(const char *name, u32 name_len, const char *folded, u32 len);
+static i32 search_substr_pos_scalar(const char *name, u32 name_len, const char *folded, u32 len);
+static inline bool search_is_word_char(char c);
+static SearchMatch search_substr_match(const char *name, u32 name_len, const char *folded, u32 len, u32 song, i32 pos);
+static int search_match_cmp(const void *a, const void *b);
+static u32 search_bitap_errors(const char *name, u32 name_len, const u64 *masks, u32 len, u32 k);
+static void search_heap_sift_down(SearchMatch *heap, u32 len, u32 i);
+static void search_heap_push(SearchMatch *heap, u32 *len, u32 cap, SearchMatch match, AIL_DA(u32) *dropped);
+static void search_sort_songs(AIL_DA(u32) *songs);
+static inline u32 search_fuzzy_max_errors(u32 len);
+static void search_rank(AIL_DA(SearchMatch) *matches, AIL_DA(u32) *out);
+static inline bool search_is_stale(void);
+
+
+static u32 search_trie_new_node(SearchTrie *trie, const char *label, u32 label_len)
+{
+    SearchTrieNode node = { .label = label, .label_len = label_len };
+    ail_da_push(&trie->nodes, node);
+    return trie->nodes.len - 1;
+}
+
+SearchTrie search_trie_build(AIL_DA(Song) library)
+{
+    SearchTrie trie = {
+        .nodes     = ail_da_new_with_cap(SearchTrieNode, 2*library.len + 1),
+        .next_song = ail_da_new_with_cap(u32, library.len + 16),
+        .stack     = ail_da_new_with_cap(u32, 64),
+    };
+    search_trie_new_node(&trie, NULL, 0);
+    for (u32 i = 0; i < library.len; i++) search_trie_insert(&trie, library.data[i].name, i);
+    return trie;
+}
+
+// Adds the song at index idx of the library, whose name was interned by the library
+void search_trie_insert(SearchTrie *trie, const char *name, u32 idx)
+{
+    const char *folded = library_name_folded(name);
+    u32 len  = library_name_len(name);
+    u32 pos  = 0;
+    u32 node = 0;
+    while (pos < len) {
+        // Find the child starting with the next byte, while remembering where a new child would need to be linked in
+        u32 prev  = 0;
+        u32 child = trie->nodes.data[node].first_child;
+        while (child && (u8)trie->nodes.data[child].label[0] < (u8)folded[pos]) {
+            prev  = child;
+            child = trie->nodes.data[child].next_sibling;
+        }
+        if (!child || trie->nodes.data[child].label[0] != folded[pos]) {
+            u32 leaf = search_trie_new_node(trie, &folded[pos], len - pos);
+            trie->nodes.data[leaf].next_sibling = child;
+            if (prev) trie->nodes.data[prev].next_sibling = leaf;
+            else      trie->nodes.data[node].first_child  = leaf;
+            node = leaf;
+            break;
+        }
+
+        SearchTrieNode c = trie->nodes.data[child];
+        u32 common = 1;
+        while (common < c.label_len && pos + common < len && c.label[common] == folded[pos + common]) common++;
+        if (common < c.label_len) {
+            // Split the child, so that the common part of both names gets its own node
+            u32 mid = search_trie_new_node(trie, c.label, common);
+            trie->nodes.data[mid].first_child    = child;
+            trie->nodes.data[mid].next_sibling   = c.next_sibling;
+            trie->nodes.data[child].label        = &c.label[common];
+            trie->nodes.data[child].label_len    = c.label_len - common;
+            trie->nodes.data[child].next_sibling = 0;
+            if (prev) trie->nodes.data[prev].next_sibling = mid;
+            else      trie->nodes.data[node].first_child  = mid;
+            child = mid;
+        }
+        node = child;
+        pos += common;
+    }
+
+    if (idx >= trie->next_song.len) {
+        ail_da_maybe_grow(&trie->next_song, idx + 1 - trie->next_song.len);
+        trie->next_song.len = idx + 1;
+    }
+    trie->next_song.data[idx] = trie->nodes.data[node].first_song;
+    trie->nodes.data[node].first_song = idx + 1;
+}
+
+// Pushes the indexes of all songs, whose case-folded name starts with folded, onto out (sorted by their case-folded names)
+void search_trie_prefixed(SearchTrie *trie, const char *folded, u32 len, AIL_DA(u32) *out)
+{
+    u32 pos  = 0;
+    u32 node = 0;
+    while (pos < len) {
+        u32 child = trie->nodes.data[node].first_child;
+        while (child && (u8)trie->nodes.data[child].label[0] < (u8)folded[pos]) child = trie->nodes.data[child].next_sibling;
+        if (!child || trie->nodes.data[child].label[0] != folded[pos]) return;
+        SearchTrieNode c = trie->nodes.data[child];
+        u32 n = AIL_MIN(c.label_len, len - pos);
+        if (memcmp(c.label, &folded[pos], n)) return;
+        node = child;
+        pos += n;
+    }
+
+    // Collect all songs below node in depth-first order
+    trie->stack.len = 0;
+    ail_da_push(&trie->stack, node);
+    while (trie->stack.len) {
+        SearchTrieNode n = trie->nodes.data[trie->stack.data[--trie->stack.len]];
+        for (u32 song = n.first_song; song; song = trie->next_song.data[song - 1]) ail_da_push(out, song - 1);
+        u32 first = trie->stack.len;
+        for (u32 child = n.first_child; child; child = trie->nodes.data[child].next_sibling) ail_da_push(&trie->stack, child);
+        // Reverse the children, so that they are popped in sorted order
+        for (u32 i = first, j = trie->stack.len; i + 1 < j; i++, j--) AIL_SWAP_PORTABLE(u32, trie->stack.data[i], trie->stack.data[j - 1]);
+    }
+}
+
+void search_trie_free(SearchTrie *trie)
+{
+    ail_da_free(&trie->nodes);
+    ail_da_free(&trie->next_song);
+    ail_da_free(&trie->stack);
+}
+
+static inline u32 search_trigram(const char *s)
+{
+    return ((u32)(u8)s[0] << 16) | ((u32)(u8)s[1] << 8) | (u32)(u8)s[2];
+}
+
+// Builds the trigram index over the n interned names
+// names are copied from the library beforehand, so that the index can be built in the background while songs are added to the library
+SearchTrigrams search_trigrams_build(char **names, u32 n)
+{
+    // Collect a (trigram, song) pair for each trigram of each name
+    // The pairs are created in order of the songs and then sorted by a stable radix sort, so that the songs of each trigram stay sorted
+    u64 total = 0;
+    for (u32 i = 0; i < n; i++) total += AIL_MAX(library_name_len(names[i]), 2) - 2;
+    u64 *pairs = malloc(total*sizeof(u64));
+    u64 *tmp   = malloc(total*sizeof(u64));
+    u64 npairs = 0;
+    for (u32 i = 0; i < n; i++) {
+        const char *folded = library_name_folded(names[i]);
+        u32 len = library_name_len(names[i]);
+        for (u32 j = 0; j + 2 < len; j++) pairs[npairs++] = ((u64)search_trigram(&folded[j]) << 32) | i;
+    }
+    for (u32 shift = 32; shift < 56; shift += 8) {
+        u64 counts[257] = { 0 };
+        for (u64 i = 0; i < npairs; i++) counts[((pairs[i] >> shift) & 0xFF) + 1]++;
+        for (u32 i = 1; i < 257; i++) counts[i] += counts[i - 1];
+        for (u64 i = 0; i < npairs; i++) tmp[counts[(pairs[i] >> shift) & 0xFF]++] = pairs[i];
+        AIL_SWAP_PORTABLE(u64 *, pairs, tmp);
+    }
+
+    SearchTrigrams index = {
+        .grams   = ail_da_new_with_cap(u32, 1024),
+        .offsets = ail_da_new_with_cap(u32, 1024),
+        .songs   = ail_da_new_with_cap(u32, npairs + 1),
+        .indexed = n,
+    };
+    for (u64 i = 0; i < npairs; i++) {
+        u32 gram = pairs[i] >> 32;
+        u32 song = pairs[i] & 0xFFFFFFFF;
+        if (!index.grams.len || index.grams.data[index.grams.len - 1] != gram) {
+            ail_da_push(&index.grams, gram);
+            ail_da_push(&index.offsets, index.songs.len);
+        } else if (index.songs.data[index.songs.len - 1] == song) {
+            continue; // The trigram appears several times in the same name
+        }
+        ail_da_push(&index.songs, song);
+    }
+    ail_da_push(&index.offsets, index.songs.len);
+    free(pairs);
+    free(tmp);
+    return index;
+}
+
+static i32 search_find_gram(SearchTrigrams *index, u32 gram)
+{
+    u32 lo = 0, hi = index->grams.len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo)/2;
+        if (index->grams.data[mid] < gram) lo = mid + 1;
+        else                               hi = mid;
+    }
+    return (lo < index->grams.len && index->grams.data[lo] == gram) ? (i32)lo : -1;
+}
+
+// Position of the first occurrence of folded in name or -1 if there is none
+// name needs to be the case-folded copy of an interned name, since up to 15 bytes after its end may be read
+static i32 search_substr_pos(const char *name, u32 name_len, const char *folded, u32 len)
+{
+#ifdef SEARCH_SSE2
+    if (name_len < len || !len) return len ? -1 : 0;
+    u32 positions = name_len - len + 1;
+    __m128i first = _mm_set1_epi8(folded[0]);
+    __m128i last  = _mm_set1_epi8(folded[len - 1]);
+    for (u32 i = 0; i < positions; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&name[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&name[i + len - 1]);
+        u32 mask  = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        if (positions - i < 16) mask &= (1u << (positions - i)) - 1;
+        while (mask) {
+            u32 pos = i + __builtin_ctz(mask);
+            if (len <= 2 || !memcmp(&name[pos + 1], &folded[1], len - 2)) return pos;
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+#else
+    return search_substr_pos_scalar(name, name_len, folded, len);
+#endif
+}
+
+static i32 search_substr_pos_scalar(const char *name, u32 name_len, const char *folded, u32 len)
+{
+    if (name_len < len) return -1;
+    for (u32 i = 0; i <= name_len - len; i++) {
+        if (name[i] == folded[0] && !memcmp(&name[i], folded, len)) return i;
+    }
+    return -1;
+}
+
+// Bytes of multi-byte UTF-8 characters count as letters
+static inline bool search_is_word_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (u8)c >= 0x80;
+}
+
+// Ranks a song, whose name (with length name_len) contains the query first at pos (which is greater than 0)
+static SearchMatch search_substr_match(const char *name, u32 name_len, const char *folded, u32 len, u32 song, i32 pos)
+{
+    SearchMatch match = { .song = song, .tier = SEARCH_TIER_SUBSTRING, .pos = pos, .len = name_len };
+    // The query might only start a word at a later occurrence
+    for (u32 p = pos;;) {
+        if (!search_is_word_char(name[p - 1])) {
+            match.tier = SEARCH_TIER_WORD_START;
+            match.pos  = p;
+            break;
+        }
+        i32 next = search_substr_pos(&name[p + 1], name_len - p - 1, folded, len);
+        if (next < 0) break;
+        p += next + 1;
+    }
+    return match;
+}
+
+static int search_match_cmp(const void *a, const void *b)
+{
+    const SearchMatch *m1 = a, *m2 = b;
+    if (m1->tier != m2->tier) return m1->tier < m2->tier ? -1 : 1;
+    if (m1->pos != m2->pos) return m1->pos < m2->pos ? -1 : 1;
+    if (m1->len != m2->len) return m1->len < m2->len ? -1 : 1;
+    return m1->song < m2->song ? -1 : m1->song > m2->song;
+}
+
+// Pushes the songs of the best SEARCH_RANK_TOP_K matches onto out sorted by their rank, followed by the songs of all other matches sorted by index
+// The best matches are selected with a bounded heap at the start of matches, so that the matches don't need to be sorted
+static void search_rank(AIL_DA(SearchMatch) *matches, AIL_DA(u32) *out)
+{
+    static AIL_DA(u32) rest;
+    if (!rest.data) rest = ail_da_new(u32);
+    rest.len = 0;
+    u32 heap_len = 0;
+    for (u32 i = 0; i < matches->len; i++) search_heap_push(matches->data, &heap_len, SEARCH_RANK_TOP_K, matches->data[i], &rest);
+    qsort(matches->data, heap_len, sizeof(SearchMatch), search_match_cmp);
+    search_sort_songs(&rest);
+    ail_da_maybe_grow(out, heap_len + rest.len);
+    for (u32 i = 0; i < heap_len; i++) out->data[out->len++] = matches->data[i].song;
+    memcpy(&out->data[out->len], rest.data, rest.len*sizeof(u32));
+    out->len += rest.len;
+}
+
+// Sorts the indexes of songs with a radix sort
+// The songs are usually sorted already (i.e. since the trigram index lists them in order), in which case they are left as they are
+static void search_sort_songs(AIL_DA(u32) *songs)
+{
+    u32 i = 1;
+    while (i < songs->len && songs->data[i - 1] <= songs->data[i]) i++;
+    if (i >= songs->len) return;
+    static AIL_DA(u32) tmp;
+    if (!tmp.data) tmp = ail_da_new(u32);
+    tmp.len = 0;
+    ail_da_maybe_grow(&tmp, songs->len);
+    u32 *src = songs->data, *dst = tmp.data;
+    for (u32 shift = 0; shift < 32; shift += 8) {
+        u32 counts[257] = { 0 };
+        for (u32 j = 0; j < songs->len; j++) counts[((src[j] >> shift) & 0xFF) + 1]++;
+        for (u32 j = 1; j < 257; j++) counts[j] += counts[j - 1];
+        for (u32 j = 0; j < songs->len; j++) dst[counts[(src[j] >> shift) & 0xFF]++] = src[j];
+        AIL_SWAP_PORTABLE(u32 *, src, dst);
+    }
+    // After an even amount of passes, the sorted songs are back in songs->data
+}
+
+// Pushes the indexes of all songs, that contain folded but don't start with it, onto out (ranked as described at the top of the file)
+// index may be NULL, if the trigram index was not built yet
+void search_substrings(SearchTrigrams *index, AIL_DA(Song) library, const char *folded, u32 len, AIL_DA(u32) *out)
+{
+    static AIL_DA(SearchMatch) matches;
+    static AIL_DA(u32)         candidates;
+    if (!matches.data)    matches    = ail_da_new(SearchMatch);
+    if (!candidates.data) candidates = ail_da_new(u32);
+    matches.len    = 0;
+    candidates.len = 0;
+
+    u32 first_unindexed = 0;
+    if (index && len >= 3) {
+        first_unindexed = AIL_MIN(index->indexed, library.len);
+        // Start with the shortest list of songs and remove all songs from it, that are missing in the lists of the other trigrams
+        i32 shortest = -1;
+        for (u32 i = 0; i + 2 < len; i++) {
+            i32 g = search_find_gram(index, search_trigram(&folded[i]));
+            if (g < 0) goto scan_unindexed;
+            u32 count = index->offsets.data[g + 1] - index->offsets.data[g];
+            if (shortest < 0 || count < index->offsets.data[shortest + 1] - index->offsets.data[shortest]) shortest = g;
+        }
+        ail_da_pushn(&candidates, &index->songs.data[index->offsets.data[shortest]], index->offsets.data[shortest + 1] - index->offsets.data[shortest]);
+        for (u32 i = 0; i + 2 < len && candidates.len; i++) {
+            i32 g = search_find_gram(index, search_trigram(&folded[i]));
+            if (g == shortest) continue;
+            u32 *list = &index->songs.data[index->offsets.data[g]];
+            u32  n    = index->offsets.data[g + 1] - index->offsets.data[g];
+            u32  kept = 0;
+            for (u32 c = 0, j = 0; c < candidates.len; c++) {
+                while (j < n && list[j] < candidates.data[c]) j++;
+                if (j < n && list[j] == candidates.data[c]) candidates.data[kept++] = candidates.data[c];
+            }
+            candidates.len = kept;
+        }
+        for (u32 c = 0; c < candidates.len; c++) {
+            if (!(c % SEARCH_CANCEL_INTERVAL) && search_is_stale()) return;
+            u32 song = candidates.data[c];
+            if (song >= library.len) continue;
+            const char *name = library_name_folded(library.data[song].name);
+            u32 name_len     = library_name_len(library.data[song].name);
+            i32 pos          = search_substr_pos(name, name_len, folded, len);
+            if (pos > 0) ail_da_push(&matches, search_substr_match(name, name_len, folded, len, song, pos));
+        }
+    }
+scan_unindexed:
+    for (u32 i = first_unindexed; i < library.len; i++) {
+        if (!(i % SEARCH_CANCEL_INTERVAL) && search_is_stale()) return;
+        const char *name = library_name_folded(library.data[i].name);
+        u32 name_len     = library_name_len(library.data[i].name);
+        i32 pos          = search_substr_pos(name, name_len, folded, len);
+        if (pos > 0) ail_da_push(&matches, search_substr_match(name, name_len, folded, len, i, pos));
+    }
+
+    search_rank(&matches, out);
+}
+
+void search_trigrams_free(SearchTrigrams *index)
+{
+    ail_da_free(&index->grams);
+    ail_da_free(&index->offsets);
+    ail_da_free(&index->songs);
+}
+
+// Returns the level of the cache, that holds the results for folded
+SearchLevel search_cached(SearchCache *cache, SearchTrie *trie, SearchTrigrams *index, AIL_DA(Song) library, const char *folded, u32 len)
+{
+    if (!cache->hits.data) {
+        cache->query  = ail_da_new(char);
+        cache->levels = ail_da_new_with_cap(SearchLevel, 32);
+        cache->hits   = ail_da_new(u32);
+    }
+    // Drop all levels, whose query is not a prefix of the new query
+    u32 common = 0;
+    while (common < len && common < cache->query.len && cache->query.data[common] == folded[common]) common++;
+    while (cache->levels.len && cache->levels.data[cache->levels.len - 1].query_len > common) cache->levels.len--;
+    cache->query.len = 0;
+    ail_da_pushn(&cache->query, folded, len);
+    cache->hits.len  = cache->levels.len ? cache->levels.data[cache->levels.len - 1].end : 0;
+
+    if (cache->levels.len && cache->levels.data[cache->levels.len - 1].query_len == len) return cache->levels.data[cache->levels.len - 1];
+
+    SearchLevel level = { .query_len = len, .start = cache->hits.len };
+    if (!cache->levels.len) {
+        search_trie_prefixed(trie, folded, len, &cache->hits);
+        level.prefixed = cache->hits.len - level.start;
+        search_substrings(index, library, folded, len, &cache->hits);
+    } else {
+        // Every song containing the new query also contains the previous one, so only the previous hits need to be checked
+        // Prefix hits stay sorted by name when being filtered, but substring hits need to be ranked again,
+        // since the position of the query in their names might have changed and some prefix hits might have become substring hits
+        static AIL_DA(SearchMatch) matches;
+        if (!matches.data) matches = ail_da_new(SearchMatch);
+        matches.len = 0;
+        SearchLevel prev = cache->levels.data[cache->levels.len - 1];
+        for (u32 i = prev.start; i < prev.end; i++) {
+            if (!((i - prev.start) % SEARCH_CANCEL_INTERVAL) && search_is_stale()) break;
+            u32 song         = cache->hits.data[i];
+            const char *name = library_name_folded(library.data[song].name);
+            u32 name_len     = library_name_len(library.data[song].name);
+            i32 pos          = search_substr_pos(name, name_len, folded, len);
+            if      (pos == 0) ail_da_push(&cache->hits, song);
+            else if (pos >  0) ail_da_push(&matches, search_substr_match(name, name_len, folded, len, song, pos));
+        }
+        level.prefixed = cache->hits.len - level.start;
+        search_rank(&matches, &cache->hits);
+    }
+    level.end = cache->hits.len;
+    // The hits of a cancelled search are incomplete and must not be cached
+    if (search_is_stale()) cache->hits.len = level.start;
+    else                   ail_da_push(&cache->levels, level);
+    return level;
+}
+
+// Amount of errors of the best match of the pattern described by masks (with length len) in name, or k + 1 if there is none with up to k errors
+// Bit i of R[d] is set, if the first i + 1 bytes of the pattern match the text ending at the current byte with up to d errors
+static u32 search_bitap_errors(const char *name, u32 name_len, const u64 *masks, u32 len, u32 k)
+{
+    u64 R[SEARCH_FUZZY_MAX_ERRORS + 1];
+    u64 done = 1ull << (len - 1);
+    u32 best = k + 1;
+    for (u32 d = 0; d <= k; d++) {
+        R[d] = (1ull << d) - 1; // Up to d bytes of the pattern can be deleted before the first byte of the name
+        if (best > k && (R[d] & done)) best = d;
+    }
+    for (u32 i = 0; i < name_len; i++) {
+        u64 mask = masks[(u8)name[i]];
+        u64 prev = R[0];
+        R[0] = ((R[0] << 1) | 1) & mask;
+        for (u32 d = 1; d <= k; d++) {
+            u64 cur = R[d];
+            // Match | insertion into the name | substitution | deletion from the name
+            R[d] = (((cur << 1) | 1) & mask) | prev | (prev << 1) | (R[d - 1] << 1) | 1;
+            prev = cur;
+        }
+        u64 any = 0;
+        for (u32 d = 0; d < best; d++) any |= R[d];
+        if (!(any & done)) continue;
+        for (u32 d = 0; d < best; d++) {
+            if (R[d] & done) {
+                best = d;
+                break;
+            }
+        }
+        if (!best) break;
+    }
+    return best;
+}
+
+static void search_heap_sift_down(SearchMatch *heap, u32 len, u32 i)
+{
+    for (;;) {
+        u32 max = i;
+        u32 l   = 2*i + 1;
+        u32 r   = 2*i + 2;
+        if (l < len && search_match_cmp(&heap[l], &heap[max]) > 0) max = l;
+        if (r < len && search_match_cmp(&heap[r], &heap[max]) > 0) max = r;
+        if (max == i) break;
+        AIL_SWAP_PORTABLE(SearchMatch, heap[i], heap[max]);
+        i = max;
+    }
+}
+
+// Adds match to the max-heap of the best matches (which holds up to cap of them)
+// The songs of matches, that don't make it into the heap or are pushed out of it, are pushed onto dropped, if it isn't NULL
+// heap may be the same list, that the matches are read from, since it never holds more matches than were pushed so far
+static void search_heap_push(SearchMatch *heap, u32 *len, u32 cap, SearchMatch match, AIL_DA(u32) *dropped)
+{
+    if (*len < cap) {
+        heap[(*len)++] = match;
+        for (u32 j = *len - 1; j && search_match_cmp(&heap[j], &heap[(j - 1)/2]) > 0; j = (j - 1)/2) {
+            AIL_SWAP_PORTABLE(SearchMatch, heap[j], heap[(j - 1)/2]);
+        }
+    } else if (search_match_cmp(&match, &heap[0]) < 0) {
+        if (dropped) ail_da_push(dropped, heap[0].song);
+        heap[0] = match;
+        search_heap_sift_down(heap, *len, 0);
+    } else if (dropped) {
+        ail_da_push(dropped, match.song);
+    }
+}
+
+// Amount of errors allowed for a query of length len, so that short queries don't match everything
+static inline u32 search_fuzzy_max_errors(u32 len)
+{
+    return len > SEARCH_FUZZY_MAX_LEN ? 0 : AIL_MIN(SEARCH_FUZZY_MAX_ERRORS, (len + 1)/4);
+}
+
+// Pushes the indexes of the best SEARCH_FUZZY_TOP_K songs, that don't contain folded but contain it with a few errors, onto out
+// The songs are ranked by their amount of errors and then by the length of their name
+void search_fuzzy(AIL_DA(Song) library, const char *folded, u32 len, AIL_DA(u32) *out)
+{
+    u32 k = search_fuzzy_max_errors(len);
+    if (!k) return;
+    u64 masks[256] = { 0 };
+    for (u32 i = 0; i < len; i++) masks[(u8)folded[i]] |= 1ull << i;
+
+    // When a name contains the query with up to k errors, at least one of k + 1 pieces of the query needs to appear in the name without errors
+    // Looking for these pieces with the vectorized kernel rejects most names much faster than running Bitap on them
+    u32 pieces[SEARCH_FUZZY_MAX_ERRORS + 2];
+    for (u32 p = 0; p <= k + 1; p++) pieces[p] = p*len/(k + 1);
+
+    // Max-heap of the best matches so far, so that the worst of them can be replaced in O(log K)
+    SearchMatch heap[SEARCH_FUZZY_TOP_K];
+    u32 heap_len = 0;
+    for (u32 i = 0; i < library.len; i++) {
+        if (!(i % SEARCH_CANCEL_INTERVAL) && search_is_stale()) return;
+        const char *name = library_name_folded(library.data[i].name);
+        u32 name_len     = library_name_len(library.data[i].name);
+        bool has_piece   = false;
+        for (u32 p = 0; p <= k && !has_piece; p++) has_piece = search_substr_pos(name, name_len, &folded[pieces[p]], pieces[p + 1] - pieces[p]) >= 0;
+        if (!has_piece) continue;
+        // Once the heap is full, only matches with fewer errors than the worst one can still get in
+        u32 max_errors = heap_len == SEARCH_FUZZY_TOP_K ? heap[0].tier - SEARCH_TIER_FUZZY + 1 : k;
+        u32 errors     = search_bitap_errors(name, name_len, masks, len, max_errors);
+        if (!errors || errors > max_errors) continue; // Exact matches are found by the other searches
+        SearchMatch match = { .song = i, .tier = SEARCH_TIER_FUZZY + errors - 1, .pos = 0, .len = name_len };
+        search_heap_push(heap, &heap_len, SEARCH_FUZZY_TOP_K, match, NULL);
+    }
+    qsort(heap, heap_len, sizeof(SearchMatch), search_match_cmp);
+    ail_da_maybe_grow(out, heap_len);
+    for (u32 i = 0; i < heap_len; i++) out->data[out->len++] = heap[i].song;
+}
+
+// Needs to be called whenever songs are added to or removed from the library
+void search_cache_clear(SearchCache *cache)
+{
+    cache->query.len  = 0;
+    cache->levels.len = 0;
+    cache->hits.len   = 0;
+}
+
+// Whether a newer search was requested, while the current one is running
+// Searches outside of the search thread are never stale, since no generation is ever requested for them
+static inline bool search_is_stale(void)
+{
+    return search_running != search_generation;
+}
+
+// Main loop of the search thread
+// _sources points to a SearchSources, that stays valid for as long as the program runs
+void *search_thread_main(void *_sources)
+{
+    SearchSources *sources = _sources;
+    AIL_DA(char) query = ail_da_new(char);
+    AIL_DA(u32)  hits  = ail_da_new(u32);
+    while (pthread_mutex_lock(&search_mutex) != 0) {}
+    if (!search_done.data) search_done = ail_da_new(u32);
+    while (pthread_mutex_unlock(&search_mutex) != 0) {}
+    while (true) {
+        while (pthread_mutex_lock(&search_mutex) != 0) {}
+        while (search_running == search_generation) pthread_cond_wait(&search_cond, &search_mutex);
+        search_running = search_generation;
+        query.len = 0;
+        ail_da_pushn(&query, search_query.data, search_query.len);
+        while (pthread_mutex_unlock(&search_mutex) != 0) {}
+
+        // An empty query only cancels the previous search
+        hits.len = 0;
+        while (pthread_mutex_lock(&search_library_mutex) != 0) {}
+        if (query.len) {
+            AIL_DA(Song) library = *sources->library;
+            SearchTrigrams *index = *sources->trigrams_ready ? sources->trigrams : NULL;
+            SearchLevel level = search_cached(&search_thread_cache, sources->trie, index, library, query.data, query.len);
+            if (!search_is_stale()) {
+                ail_da_pushn(&hits, &search_thread_cache.hits.data[level.start], level.end - level.start);
+                // Songs containing the query with typos are listed last and only looked for, if there are few exact matches
+                if (hits.len < SEARCH_FUZZY_TOP_K) search_fuzzy(library, query.data, query.len, &hits);
+            }
+        }
+        while (pthread_mutex_unlock(&search_library_mutex) != 0) {}
+        if (search_is_stale()) continue;
+
+        while (pthread_mutex_lock(&search_mutex) != 0) {}
+        AIL_SWAP_PORTABLE(AIL_DA(u32), hits, search_done);
+        search_done_gen = search_running;
+        while (pthread_mutex_unlock(&search_mutex) != 0) {}
+    }
+    return NULL;
+}
+
+// Requests a search for all songs containing query (ignoring case) - the results are returned by search_poll
+// Any search, that was requested before, is cancelled
+// Returns the generation of the request, which search_poll returns once its results are available
+u32 search_request(const char *query)
+{
+    u32 len = strlen(query);
+    while (pthread_mutex_lock(&search_mutex) != 0) {}
+    if (!search_query.data) search_query = ail_da_new_with_cap(char, len + 1);
+    search_query.len = 0;
+    // The query is case-folded once, so that it can be compared directly against the case-folded names of the library
+    for (u32 i = 0; i < len; i++) ail_da_push(&search_query, (query[i] >= 'A' && query[i] <= 'Z') ? query[i] + 'a' - 'A' : query[i]);
+    u32 gen = ++search_generation;
+    pthread_cond_signal(&search_cond);
+    while (pthread_mutex_unlock(&search_mutex) != 0) {}
+    return gen;
+}
+
+// Fills results with the songs of the newest completed search, starting with the ones that have the query as a prefix
+// Returns the generation of the request, that produced the results, or 0 without changing results, if no search completed since the last call
+u32 search_poll(AIL_DA(Song) library, AIL_DA(Song) *results)
+{
+    u32 updated = 0;
+    while (pthread_mutex_lock(&search_mutex) != 0) {}
+    if (search_done_gen != search_polled_gen) {
+        search_polled_gen = search_done_gen;
+        if (!results->data) *results = ail_da_new(Song);
+        results->len = 0;
+        ail_da_maybe_grow(results, search_done.len);
+        for (u32 i = 0; i < search_done.len; i++) results->data[results->len++] = library.data[search_done.data[i]];
+        updated = search_done_gen;
+    }
+    while (pthread_mutex_unlock(&search_mutex) != 0) {}
+    return updated;
+}
+
+void search_library_lock(void)
+{
+    while (pthread_mutex_lock(&search_library_mutex) != 0) {}
+}
+
+void search_library_unlock(void)
+{
+    while (pthread_mutex_unlock(&search_library_mutex) != 0) {}
+}
+
+// Needs to be called while holding search_library_lock, whenever songs were added to or removed from the library
+void search_library_changed(void)
+{
+    search_cache_clear(&search_thread_cache);
+}
+
+#endif // SEARCH_C_
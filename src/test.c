@@ -1,5 +1,9 @@
 #define AIL_ALL_IMPL
 #include "common.h"
+#include "pidi.c"
+#include "midi.c"
+#include "library.c"
+#include "search.c"
 
 bool cmd_eq(PidiCmd c1, PidiCmd c2)
 {
@@ -12,6 +16,336 @@ bool cmd_eq(PidiCmd c1, PidiCmd c2)
 	);
 }
 
+// Checks that library contains exactly the songs with the given names and lengths in this order
+// The metadata of each song needs to have its length as hash (see add_song)
+void expect_library(AIL_DA(Song) library, const char **names, const u64 *lens, u32 n)
+{
+	AIL_ASSERT(library.len == n);
+	for (u32 i = 0; i < n; i++) {
+		u32 name_len = strlen(names[i]);
+		AIL_ASSERT(library_name_len(library.data[i].name) == name_len && !memcmp(library.data[i].name, names[i], name_len));
+		AIL_ASSERT(library.data[i].len == lens[i]);
+		AIL_ASSERT(library_song_meta_of(library.data[i].name)->hash == lens[i]);
+		AIL_ASSERT(library_song_meta_of(library.data[i].name)->density[0] == 255);
+	}
+}
+
+void add_song(AIL_DA(Song) *library, const char *name, u64 len, LibraryFiles *files)
+{
+	SongMeta meta = { .hash = len, .notes = 1, .max_key = 87, .density = { 255 } };
+	Song song     = { .name = (char *)name, .len = len };
+	AIL_ASSERT(library_add(library, song, &meta, files));
+}
+
+// Storing the library as a snapshot and journal needs to give back the same library after every kind of change,
+// after a crash while writing a record, after compacting and when replaying a journal that was already compacted into the snapshot
+void test_library(void)
+{
+	LibraryFiles files = { .snapshot_path = "test.pdil", .journal_path = "test.pdij" };
+	remove(files.snapshot_path);
+	remove(files.journal_path);
+	AIL_DA(Song) library = library_load(&files);
+	AIL_ASSERT(library.len == 0);
+
+	add_song(&library, "Clair de Lune", 1, &files);
+	add_song(&library, "Gymnopedie", 2, &files);
+	add_song(&library, "Arabesque", 3, &files);
+	AIL_ASSERT(library_rename(&library, 1, "Gymnopedie No. 1", &files));
+	AIL_ASSERT(library_delete(&library, 0, &files));
+	add_song(&library, "Gymnopedie", 4, &files);
+	const char *names[] = { "Gymnopedie No. 1", "Arabesque", "Gymnopedie" };
+	const u64   lens[]  = { 2, 3, 4 };
+	expect_library(library, names, lens, 3);
+	ail_da_free(&library);
+	library = library_load(&files);
+	expect_library(library, names, lens, 3);
+
+	// A torn record at the end of the journal is ignored
+	AIL_Buffer journal = ail_buf_from_file(files.journal_path);
+	FILE *f = fopen(files.journal_path, "ab");
+	const u8 torn[] = { LIBRARY_RECORD_ADD, 100, 0, 0, 0, 5, 0, 0, 0 };
+	AIL_ASSERT(f && fwrite(torn, 1, sizeof(torn), f) == sizeof(torn) && !fclose(f));
+	ail_da_free(&library);
+	library = library_load(&files);
+	expect_library(library, names, lens, 3);
+
+	// Records appended after a torn record are not lost
+	add_song(&library, "Nocturne", 5, &files);
+	ail_da_free(&library);
+	library = library_load(&files);
+	const char *names_after_torn[] = { "Gymnopedie No. 1", "Arabesque", "Gymnopedie", "Nocturne" };
+	const u64   lens_after_torn[]  = { 2, 3, 4, 5 };
+	expect_library(library, names_after_torn, lens_after_torn, 4);
+	AIL_ASSERT(library_delete(&library, 3, &files));
+
+	// Replaying the whole journal again on top of its compacted snapshot (i.e. after a crash before the journal was cleared) changes nothing,
+	// even though the old name of the renamed song was taken by a song added later
+	AIL_ASSERT(library_compact(library, &files));
+	AIL_ASSERT(files.journal_records == 0);
+	AIL_ASSERT(ail_buf_to_file(&journal, files.journal_path));
+	free(journal.data);
+	ail_da_free(&library);
+	library = library_load(&files);
+	expect_library(library, names, lens, 3);
+
+	// The journal is compacted automatically once it has more records than the last snapshot has songs
+	char added[LIBRARY_COMPACT_MIN_RECORDS][16];
+	for (u32 i = 0; i < LIBRARY_COMPACT_MIN_RECORDS; i++) {
+		sprintf(added[i], "Song %u", i);
+		add_song(&library, added[i], 5 + i, &files);
+	}
+	AIL_ASSERT(files.journal_records < LIBRARY_COMPACT_MIN_RECORDS);
+	ail_da_free(&library);
+	library = library_load(&files);
+	AIL_ASSERT(library.len == 3 + LIBRARY_COMPACT_MIN_RECORDS);
+	for (u32 i = 0; i < LIBRARY_COMPACT_MIN_RECORDS; i++) AIL_ASSERT(!strcmp(library.data[3 + i].name, added[i]) && library.data[3 + i].len == 5 + i);
+	ail_da_free(&library);
+
+	// Snapshots of version 1 have neither a version nor metadata and are upgraded when being compacted
+	AIL_Buffer v1 = ail_buf_new(64);
+	ail_buf_write4msb(&v1, PDIL_MAGIC);
+	ail_buf_write4lsb(&v1, 2);
+	for (u32 i = 0; i < 2; i++) {
+		ail_buf_write4lsb(&v1, strlen(names[i]));
+		ail_buf_write8lsb(&v1, lens[i]);
+		ail_buf_writestr(&v1, names[i], strlen(names[i]));
+	}
+	AIL_ASSERT(ail_buf_to_file(&v1, files.snapshot_path));
+	free(v1.data);
+	remove(files.journal_path);
+	library = library_load(&files);
+	AIL_ASSERT(library.len == 2);
+	for (u32 i = 0; i < 2; i++) {
+		SongMeta *meta = (SongMeta *)library_song_meta_of(library.data[i].name);
+		AIL_ASSERT(meta->hash == 0 && meta->notes == 0);
+		meta->hash       = lens[i];
+		meta->density[0] = 255;
+	}
+	AIL_ASSERT(library_compact(library, &files));
+	ail_da_free(&library);
+	AIL_Buffer v2 = ail_buf_from_file(files.snapshot_path);
+	v2.idx = 4;
+	AIL_ASSERT(ail_buf_read4lsb(&v2) == (LIBRARY_VERSION_FLAG | LIBRARY_VERSION));
+	free(v2.data);
+	library = library_load(&files);
+	expect_library(library, names, lens, 2);
+	ail_da_free(&library);
+
+	// A library, that songs are only ever added to, is compacted as well
+	remove(files.snapshot_path);
+	remove(files.journal_path);
+	library = library_load(&files);
+	for (u32 i = 0; i < 2*LIBRARY_COMPACT_MIN_RECORDS + 1; i++) {
+		char name[16];
+		sprintf(name, "Song %u", i);
+		add_song(&library, name, i, &files);
+		if (i == LIBRARY_COMPACT_MIN_RECORDS - 1) {
+			AIL_ASSERT(files.journal_records == 0 && files.snapshot_songs == LIBRARY_COMPACT_MIN_RECORDS);
+			AIL_Buffer snapshot = ail_buf_from_file(files.snapshot_path);
+			AIL_Buffer cleared  = ail_buf_from_file(files.journal_path);
+			AIL_ASSERT(snapshot.len > 12 && cleared.len == 4);
+			free(snapshot.data);
+			free(cleared.data);
+		}
+	}
+	// The next compaction happens once the journal has one more record than the snapshot has songs
+	AIL_ASSERT(files.journal_records == 0 && files.snapshot_songs == 2*LIBRARY_COMPACT_MIN_RECORDS + 1);
+	ail_da_free(&library);
+	library = library_load(&files);
+	AIL_ASSERT(library.len == 2*LIBRARY_COMPACT_MIN_RECORDS + 1 && files.journal_records == 0);
+	for (u32 i = 0; i < library.len; i++) AIL_ASSERT(library.data[i].len == i && library_song_meta_of(library.data[i].name)->hash == i);
+	ail_da_free(&library);
+
+	remove(files.snapshot_path);
+	remove(files.journal_path);
+}
+
+static u32 test_rand_state = 2463534242u;
+
+// xorshift32, so that every run tests the exact same input
+static u32 test_rand(void)
+{
+	test_rand_state ^= test_rand_state << 13;
+	test_rand_state ^= test_rand_state >> 17;
+	test_rand_state ^= test_rand_state << 5;
+	return test_rand_state;
+}
+
+// Generates n songs with random names of up to max_len bytes from alphabet
+// Small alphabets give many names sharing prefixes and substrings
+AIL_DA(Song) random_library(u32 n, const char *alphabet, u32 max_len)
+{
+	AIL_DA(Song) library = ail_da_new_with_cap(Song, n);
+	u32 alphabet_len = strlen(alphabet);
+	char name[64];
+	for (u32 i = 0; i < n; i++) {
+		u32 len = test_rand() % (max_len + 1);
+		for (u32 j = 0; j < len; j++) name[j] = alphabet[test_rand() % alphabet_len];
+		Song song = { .name = library_intern(name, len, NULL) };
+		ail_da_push(&library, song);
+	}
+	return library;
+}
+
+// Prefix queries on the trie need to find exactly the songs starting with the query, sorted by their case-folded names,
+// no matter whether the songs were there when the trie was built or were inserted afterwards
+void test_search_trie(void)
+{
+	AIL_DA(Song) library = random_library(3000, "abAB c", 7);
+	AIL_DA(Song) built   = library;
+	built.len = 2000;
+	SearchTrie trie = search_trie_build(built);
+	for (u32 i = built.len; i < library.len; i++) search_trie_insert(&trie, library.data[i].name, i);
+
+	AIL_DA(u32) found = ail_da_new(u32);
+	u8 *seen = malloc(library.len);
+	for (u32 q = 0; q < 2000; q++) {
+		char query[8];
+		u32 len = test_rand() % 5;
+		for (u32 j = 0; j < len; j++) query[j] = "ab c"[test_rand() % 4];
+		found.len = 0;
+		search_trie_prefixed(&trie, query, len, &found);
+		memset(seen, 0, library.len);
+		for (u32 i = 0; i < found.len; i++) {
+			const char *folded = library_name_folded(library.data[found.data[i]].name);
+			AIL_ASSERT(!seen[found.data[i]]);
+			AIL_ASSERT(library_name_len(library.data[found.data[i]].name) >= len && !memcmp(folded, query, len));
+			AIL_ASSERT(!i || strcmp(library_name_folded(library.data[found.data[i - 1]].name), folded) <= 0);
+			seen[found.data[i]] = 1;
+		}
+		u32 expected = 0;
+		for (u32 i = 0; i < library.len; i++) expected += library_name_len(library.data[i].name) >= len && !memcmp(library_name_folded(library.data[i].name), query, len);
+		AIL_ASSERT(found.len == expected);
+	}
+	free(seen);
+	ail_da_free(&found);
+	search_trie_free(&trie);
+	ail_da_free(&library);
+}
+
+// Typing and deleting characters needs to give the same results from the cache as searching for every query from scratch, including their order
+// Only part of the library is covered by the trigram index, like after importing songs while the index was built
+void test_search_cache(void)
+{
+	AIL_DA(Song) library = random_library(3000, "abAB cd", 11);
+	char **names = malloc(library.len*sizeof(char *));
+	for (u32 i = 0; i < library.len; i++) names[i] = library.data[i].name;
+	SearchTrie     trie  = search_trie_build(library);
+	SearchTrigrams index = search_trigrams_build(names, 2500);
+	SearchCache    cache = { 0 };
+	AIL_DA(u32) fresh = ail_da_new(u32);
+	char query[8];
+	u32  len = 0;
+	for (u32 step = 0; step < 20000; step++) {
+		u32 action = test_rand() % 10;
+		if      (action < 5 && len < sizeof(query)) query[len++] = "ab cd"[test_rand() % 5];
+		else if (action < 8 && len > 0)            len--;
+		else if (action == 8)                      len = 0;
+		else if (len > 0)                          query[len - 1] = "ab cd"[test_rand() % 5];
+		if (!len) continue;
+		// The trigram index only becomes available at some point
+		SearchTrigrams *used = step < 10000 ? NULL : &index;
+		SearchLevel level = search_cached(&cache, &trie, used, library, query, len);
+		fresh.len = 0;
+		search_trie_prefixed(&trie, query, len, &fresh);
+		u32 prefixed = fresh.len;
+		search_substrings(used, library, query, len, &fresh);
+		AIL_ASSERT(level.prefixed == prefixed && level.end - level.start == fresh.len);
+		AIL_ASSERT(!memcmp(&cache.hits.data[level.start], fresh.data, fresh.len*sizeof(u32)));
+	}
+	ail_da_free(&fresh);
+	ail_da_free(&cache.query);
+	ail_da_free(&cache.levels);
+	ail_da_free(&cache.hits);
+	search_trigrams_free(&index);
+	search_trie_free(&trie);
+	free(names);
+	ail_da_free(&library);
+}
+
+// Smallest amount of insertions, deletions and substitutions needed to turn pattern into any substring of text
+u32 edit_distance_in(const char *text, u32 text_len, const char *pattern, u32 len)
+{
+	u32 *prev = malloc((text_len + 1)*sizeof(u32));
+	u32 *cur  = malloc((text_len + 1)*sizeof(u32));
+	for (u32 j = 0; j <= text_len; j++) prev[j] = 0; // The substring can start anywhere
+	for (u32 i = 1; i <= len; i++) {
+		cur[0] = i;
+		for (u32 j = 1; j <= text_len; j++) {
+			u32 substitute = prev[j - 1] + (pattern[i - 1] != text[j - 1]);
+			cur[j] = AIL_MIN(substitute, AIL_MIN(prev[j], cur[j - 1]) + 1);
+		}
+		AIL_SWAP_PORTABLE(u32 *, prev, cur);
+	}
+	u32 best = len;
+	for (u32 j = 0; j <= text_len; j++) best = AIL_MIN(best, prev[j]);
+	free(prev);
+	free(cur);
+	return best;
+}
+
+// Bitap needs to find the same amount of errors as the edit distance, fuzzy search needs to return the best of all fuzzy matches
+// and ranking substring matches needs to rank the best ones as if all matches were sorted
+void test_search_fuzzy(void)
+{
+	for (u32 i = 0; i < 200000; i++) {
+		char text[32], pattern[16];
+		u32 text_len = test_rand() % 30;
+		u32 len      = 1 + test_rand() % 12;
+		u32 k        = test_rand() % (SEARCH_FUZZY_MAX_ERRORS + 1);
+		for (u32 j = 0; j < text_len; j++) text[j]    = "abc"[test_rand() % 3];
+		for (u32 j = 0; j < len; j++)      pattern[j] = "abc"[test_rand() % 3];
+		u64 masks[256] = { 0 };
+		for (u32 j = 0; j < len; j++) masks[(u8)pattern[j]] |= 1ull << j;
+		u32 expected = AIL_MIN(edit_distance_in(text, text_len, pattern, len), k + 1);
+		AIL_ASSERT(search_bitap_errors(text, text_len, masks, len, k) == expected);
+	}
+
+	AIL_DA(Song) library = random_library(5000, "abcde ", 22);
+	AIL_DA(u32)         found   = ail_da_new(u32);
+	AIL_DA(SearchMatch) matches = ail_da_new(SearchMatch);
+	for (u32 q = 0; q < 300; q++) {
+		char query[16];
+		u32 len = 1 + test_rand() % 10;
+		for (u32 j = 0; j < len; j++) query[j] = "abcde "[test_rand() % 6];
+		u32 k = search_fuzzy_max_errors(len);
+		u64 masks[256] = { 0 };
+		for (u32 j = 0; j < len; j++) masks[(u8)query[j]] |= 1ull << j;
+		matches.len = 0;
+		for (u32 i = 0; i < library.len; i++) {
+			const char *name = library_name_folded(library.data[i].name);
+			u32 name_len     = library_name_len(library.data[i].name);
+			u32 errors       = k ? edit_distance_in(name, name_len, query, len) : 0;
+			SearchMatch match = { .song = i, .tier = SEARCH_TIER_FUZZY + errors - 1, .pos = 0, .len = name_len };
+			if (errors && errors <= k) ail_da_push(&matches, match);
+		}
+		qsort(matches.data, matches.len, sizeof(SearchMatch), search_match_cmp);
+		found.len = 0;
+		search_fuzzy(library, query, len, &found);
+		AIL_ASSERT(found.len == AIL_MIN(matches.len, SEARCH_FUZZY_TOP_K));
+		for (u32 i = 0; i < found.len; i++) AIL_ASSERT(found.data[i] == matches.data[i].song);
+
+		// Substring matches: the best SEARCH_RANK_TOP_K in order of their rank, followed by all others in order of the library
+		matches.len = 0;
+		for (u32 i = 0; i < library.len; i++) {
+			const char *name = library_name_folded(library.data[i].name);
+			u32 name_len     = library_name_len(library.data[i].name);
+			i32 pos          = search_substr_pos_scalar(name, name_len, query, len);
+			if (pos > 0) ail_da_push(&matches, search_substr_match(name, name_len, query, len, i, pos));
+		}
+		qsort(matches.data, matches.len, sizeof(SearchMatch), search_match_cmp);
+		found.len = 0;
+		search_substrings(NULL, library, query, len, &found);
+		AIL_ASSERT(found.len == matches.len);
+		u32 ranked = AIL_MIN(matches.len, SEARCH_RANK_TOP_K);
+		for (u32 i = 0; i < ranked; i++) AIL_ASSERT(found.data[i] == matches.data[i].song);
+		for (u32 i = ranked + 1; i < found.len; i++) AIL_ASSERT(found.data[i - 1] < found.data[i]);
+	}
+	ail_da_free(&matches);
+	ail_da_free(&found);
+	ail_da_free(&library);
+}
+
 int main(void)
 {
 	AIL_Buffer buffer = ail_buf_new(64);
@@ -41,6 +375,150 @@ int main(void)
 		}
 	}
 
+	// Decoding many commands at once needs to give the same result as decoding them one by one
+	// n is not a multiple of PIDI_DECODE_BATCH, so that the commands after the last full batch are tested as well
+	u32 n = 16*PIANO_KEY_AMOUNT*MAX_VELOCITY + 3;
+	AIL_Buffer batch = ail_buf_new(n*ENCODED_CMD_LEN);
+	PidiCmd *cmds    = malloc(n*sizeof(PidiCmd));
+	PidiCmd *decoded = malloc(n*sizeof(PidiCmd));
+	for (u32 i = 0; i < n; i++) {
+		cmds[i] = (PidiCmd) {
+			.key      = i % PIANO_KEY_AMOUNT,
+			.octave   = (i8)((i / PIANO_KEY_AMOUNT) % 16) - 8,
+			.velocity = i % MAX_VELOCITY,
+			.dt       = (i*7) % 1000,
+			.len      = i % 100,
+		};
+		encode_cmd(&batch, cmds[i]);
+	}
+	pidi_decode_cmds(batch.data, decoded, n);
+	batch.idx = 0;
+	for (u32 i = 0; i < n; i++) {
+		PidiCmd single = decode_cmd(&batch);
+		if (!cmd_eq(cmds[i], decoded[i]) || !cmd_eq(single, decoded[i])) {
+			printf("Original Command:      ");
+			print_cmd(cmds[i]);
+			printf("Batch-Decoded Command: ");
+			print_cmd(decoded[i]);
+		}
+		AIL_ASSERT(cmd_eq(cmds[i], decoded[i]));
+		AIL_ASSERT(cmd_eq(single, decoded[i]));
+	}
+
+	// The mapped current version, the compressed current version and the decoded version 1 of a file need to load the same commands
+	const char *fpath = "test.pidi";
+	AIL_Buffer files[3] = { pidi_encode(cmds, n, false), pidi_encode(cmds, n, true), ail_buf_new(8 + n*ENCODED_CMD_LEN) };
+	ail_buf_write4msb(&files[2], PIDI_MAGIC);
+	ail_buf_write4lsb(&files[2], n);
+	ail_buf_writestr(&files[2], (const char *)batch.data, n*ENCODED_CMD_LEN);
+	for (u32 f = 0; f < 3; f++) {
+		AIL_ASSERT(ail_buf_to_file(&files[f], fpath));
+		AIL_DA(PidiCmd) loaded;
+		PidiIndex index;
+		AIL_ASSERT(pidi_load(fpath, &loaded, &index));
+		AIL_ASSERT(loaded.len == n);
+		for (u32 i = 0; i < n; i++) AIL_ASSERT(cmd_eq(cmds[i], loaded.data[i]));
+
+		// Seeking with the index needs to find the same position and held keys as scanning from the start
+		AIL_DA(MsgPidiPlayedKey) expected = ail_da_new(MsgPidiPlayedKey);
+		AIL_DA(MsgPidiPlayedKey) found    = ail_da_new(MsgPidiPlayedKey);
+		for (u32 time = 0; time < 1000*n/2; time += 997) {
+			expected.len = 0;
+			found.len    = 0;
+			u32 i = 0;
+			u32 prev_cmd_time = 0;
+			for (; i < n && prev_cmd_time + cmds[i].dt < time; i++) {
+				u32 end_time = prev_cmd_time + cmds[i].dt + cmds[i].len*LEN_FACTOR;
+				if (time < end_time) {
+					MsgPidiPlayedKey pk = { .key = cmds[i].key, .octave = cmds[i].octave, .len = (end_time - time)/LEN_FACTOR, .velocity = cmds[i].velocity };
+					ail_da_push(&expected, pk);
+				}
+				prev_cmd_time += cmds[i].dt;
+			}
+			AIL_ASSERT(pidi_index_seek(&index, loaded.data, loaded.len, time, &found) == i);
+			AIL_ASSERT(found.len == expected.len);
+			for (u32 j = 0; j < found.len; j++) AIL_ASSERT(!memcmp(&found.data[j], &expected.data[j], sizeof(MsgPidiPlayedKey)));
+		}
+		ail_da_free(&expected);
+		ail_da_free(&found);
+		pidi_index_free(&index);
+		ail_da_free(&loaded);
+	}
+	// A stored index with held keys outside of the index must be rebuilt instead of being read past the end of the file
+	for (u32 corrupt = 0; corrupt < 2; corrupt++) {
+		AIL_Buffer file = ail_buf_new(files[0].len);
+		ail_buf_writestr(&file, (const char *)files[0].data, files[0].len);
+		PidiBlock *blocks = (PidiBlock *)&file.data[pidi_index_offset(n)];
+		u32 nkeys = file.data[20] | file.data[21] << 8 | file.data[22] << 16 | (u32)file.data[23] << 24;
+		AIL_ASSERT(blocks[2].keys_idx < nkeys);
+		if (corrupt) blocks[1].keys_idx = 0xFFFFFFFF; // Past the keys
+		else         blocks[1].keys_idx = nkeys;      // Greater than the next block's
+		AIL_ASSERT(ail_buf_to_file(&file, fpath));
+		AIL_DA(PidiCmd) loaded;
+		PidiIndex index;
+		AIL_ASSERT(pidi_load(fpath, &loaded, &index));
+		AIL_ASSERT(index.held.data != NULL); // Only rebuilt indexes keep the held keys for extending them
+		PidiIndex expected = pidi_index_new();
+		pidi_index_extend(&expected, cmds, n);
+		AIL_ASSERT(index.blocks.len == expected.blocks.len && index.keys.len == expected.keys.len);
+		for (u32 i = 0; i < index.blocks.len; i++) AIL_ASSERT(index.blocks.data[i].keys_idx == expected.blocks.data[i].keys_idx);
+		pidi_index_free(&expected);
+		pidi_index_free(&index);
+		ail_da_free(&loaded);
+		free(file.data);
+	}
+
+	// A truncated compressed file must be rejected instead of being decoded into garbage
+	files[1].len -= 3;
+	AIL_ASSERT(ail_buf_to_file(&files[1], fpath));
+	AIL_DA(PidiCmd) truncated;
+	PidiIndex truncated_index;
+	AIL_ASSERT(!pidi_load(fpath, &truncated, &truncated_index));
+	// So must a compressed file claiming more commands than its data could decompress to, before allocating memory for them
+	files[1].len = PIDI_HEADER_SIZE;
+	files[1].data[12] = files[1].data[13] = files[1].data[14] = files[1].data[15] = 0xFF;
+	AIL_ASSERT(ail_buf_to_file(&files[1], fpath));
+	AIL_ASSERT(!pidi_load(fpath, &truncated, &truncated_index));
+	remove(fpath);
+	free(cmds);
+	free(decoded);
+
+	// MIDI files with notes or velocities above 127 must be rejected instead of indexing past the open notes of a track
+	const u8 bad_notes[][4] = {
+		{ 0x00, 0x90, 0xC0, 0x40 }, // Note
+		{ 0x00, 0x90, 0x40, 0xC0 }, // Velocity
+		{ 0x00, 0x80, 0xFF, 0x00 }, // Note-off
+	};
+	for (u32 i = 0; i < sizeof(bad_notes)/sizeof(*bad_notes); i++) {
+		const u8 header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96, 'M', 'T', 'r', 'k', 0, 0, 0, 8 };
+		const u8 good[]   = { 0x00, 0x90, 0x3C, 0x40 };
+		AIL_Buffer midi = ail_buf_new(sizeof(header) + 8);
+		ail_buf_writestr(&midi, (const char *)header, sizeof(header));
+		ail_buf_writestr(&midi, (const char *)good, sizeof(good));
+		ail_buf_writestr(&midi, (const char *)bad_notes[i], sizeof(bad_notes[i]));
+		midi.idx = 0;
+		AIL_ASSERT(!parse_midi(midi, &ail_default_allocator).succ);
+		// Without the invalid note, the same file is valid
+		memcpy(&midi.data[sizeof(header) + sizeof(good)], good, sizeof(good));
+		ParseMidiRes res = parse_midi(midi, &ail_default_allocator);
+		AIL_ASSERT(res.succ && res.val.song.cmds.len == 2);
+		ail_da_free(&res.val.song.cmds);
+		free(midi.data);
+	}
+
+	// MIDI files without ticks per quarter-note must be rejected instead of dividing by 0 when converting ticks to milliseconds
+	const u8 no_ticks[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 0, 'M', 'T', 'r', 'k', 0, 0, 0, 8, 0x00, 0x90, 0x3C, 0x40, 0x60, 0x80, 0x3C, 0x00 };
+	AIL_Buffer no_ticks_midi = { .data = (u8 *)no_ticks, .idx = 0, .len = sizeof(no_ticks), .cap = sizeof(no_ticks) };
+	AIL_ASSERT(!parse_midi(no_ticks_midi, &ail_default_allocator).succ);
+	MidiStream no_ticks_stream;
+	char no_ticks_err[256];
+	AIL_ASSERT(!midi_stream_open(&no_ticks_stream, no_ticks_midi, no_ticks_err));
+
+	test_library();
+	test_search_trie();
+	test_search_cache();
+	test_search_fuzzy();
+
 	printf("\033[32mTest successful!\033[0m\n");
 	return 0;
 }
\ No newline at end of file